@@ -3,25 +3,39 @@
 
 #include <iostream>
 #include <algorithm>
+#include <functional>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 
 /* Card/Player section */
 
 
-Player::Player(queue<DeferredEvent*>& _event_queue) : field(), hand(), deck(), event_queue(_event_queue)
+Player::Player(queue<DeferredEvent*>& _event_queue) : field(), hand(), deck(), is_field_dirty(false), is_hand_dirty(false), is_deck_dirty(false), field_atk_sum(0), field_taunt_hp_sum(0), cards_hash(0), event_queue(_event_queue), replay(nullptr), replay_player_index(0)
 {
 }
 
-Player::Player(const string& _name, int _hp, const vector<Card*>& _deck, bool _is_guest, queue<DeferredEvent*>& _event_queue) : name(_name), is_lost(false), is_turn_active(false), turn_num(0), max_mp(0), mp_loss(0), fatigue(0), field(), hand(), deck(_deck), field_size_adjust(0), hand_size_adjust(0), deck_size_adjust(0), is_guest(_is_guest), is_exploration(false), event_queue(_event_queue), input_func(&Player::TakeInputs)
+Player::Player(const string& _name, int _hp, const vector<Card*>& _deck, bool _is_guest, queue<DeferredEvent*>& _event_queue) : name(_name), is_lost(false), is_turn_active(false), turn_num(0), max_mp(0), mp_loss(0), fatigue(0), field(), hand(), deck(_deck), field_size_adjust(0), hand_size_adjust(0), deck_size_adjust(0), is_field_dirty(false), is_hand_dirty(false), is_deck_dirty(false), field_atk_sum(0), field_taunt_hp_sum(0), cards_hash(0), is_guest(_is_guest), is_exploration(false), event_queue(_event_queue), input_func(&Player::TakeInputs), replay(nullptr), replay_player_index(0)
 {
 	leader = CreateDefaultLeader(_hp);
 	leader->card_pos = CARD_POS_AT_LEADER;
 	for (auto it = deck.begin(); it != deck.end(); it++)
 		(*it)->card_pos = CARD_POS_AT_DECK;
+	RecomputeCardsHash();
+	rollout_policy = ROLLOUT_POLICY_RANDOM;
 }
 
 Player::Player(const string & _name, int _hp, const vector<Card*>& _deck, bool _is_guest, queue<DeferredEvent*>& _event_queue, unsigned _ai_level) : Player(_name, _hp, _deck, _is_guest, _event_queue)
 {
 	ai_level = _ai_level;
+	root_policy = default_root_policy;
+	rollout_policy = default_rollout_policy;
 	if (ai_level > 9)
 		ai_level = 9;
 	else if (ai_level < 0)
@@ -49,6 +63,7 @@ Player::~Player()
 
 Player* Player::CreateKnowledgeCopy(unsigned mode, queue<DeferredEvent*>& event_queue, PtrRedirMap& redir_map) const
 {
+	AllocPoolScope pool_scope;
 	Player* new_player = new Player(event_queue);
 
 	// leader, field, hand, and deck
@@ -62,14 +77,14 @@ Player* Player::CreateKnowledgeCopy(unsigned mode, queue<DeferredEvent*>& event_
 	{
 		Card* tmp_card = *it;
 		if (mode == COPY_OPPO)
-			new_player->hand.push_back(GenerateCard(GetRandInt()));
+			new_player->hand.push_back(use_ismcts ? SampleHiddenCard() : GenerateCard(GetRandInt()));
 		else
 			new_player->hand.push_back(tmp_card->CreateHardCopy(redir_map));
 	}
 	for (auto it = deck.begin(); it != deck.end(); it++)
 	{
 		Card* tmp_card = *it;
-		new_player->deck.push_back(GenerateCard(GetRandInt()));
+		new_player->deck.push_back(use_ismcts ? SampleHiddenCard() : GenerateCard(GetRandInt()));
 	}
 
 	// other status, note: do not need to assign the opponent as the opponent must alse be copied in order for exploration to work (after they are both copied they the opponent pointers needs to be set to the copy of each other)
@@ -85,6 +100,9 @@ Player* Player::CreateKnowledgeCopy(unsigned mode, queue<DeferredEvent*>& event_
 	new_player->field_size_adjust = field_size_adjust;
 	new_player->hand_size_adjust = hand_size_adjust;
 	new_player->deck_size_adjust = deck_size_adjust;
+	new_player->rollout_policy = rollout_policy;
+	new_player->RecomputeAggregates();
+	new_player->RecomputeCardsHash();
 
 	return new_player;
 }
@@ -207,94 +225,79 @@ void Player::ClearCorpse()
 		leader->is_resetting = false;
 	}
 
-	// field
-	for (int i = field.size() - 1; i >= 0; i--)
-	{
-		Card* tmp_card = field[i];
-		if (!tmp_card) // for moved minions
-		{
-			field.erase(field.begin() + i);
-			field_size_adjust++;
-		}
-		else if (tmp_card->is_resetting) // a dying card cannot have its state reset (or affected by any effects), so if it is both resetting and dying it must be reset first, so we check for resetting first
-		{
-			tmp_card->ClearExtraEffects();
-			tmp_card->is_resetting = false; // don't forget to set it back
-		}
-		else if (tmp_card->is_dying) // for transformed/destroyed/discarded minions
-		{
-			if (tmp_card->replacement) // transformed
-			{
-				field[i] = tmp_card->replacement;
-				delete tmp_card;
-			}
-			else // destroyed/discarded
-			{
-				field.erase(field.begin() + i);
-				delete tmp_card;
-				field_size_adjust++;
-			}
-		}
-	}
+	// only zones that may have been touched since the last clearing need to be scanned
+	if (is_field_dirty)
+		CompactZone(field, field_size_adjust, is_field_dirty);
+	if (is_hand_dirty)
+		CompactZone(hand, hand_size_adjust, is_hand_dirty);
+	if (is_deck_dirty)
+		CompactZone(deck, deck_size_adjust, is_deck_dirty);
+}
 
-	// hand
-	for (int i = hand.size() - 1; i >= 0; i--)
+void Player::CompactZone(vector<Card*>& zone, int& size_adjust, bool& is_dirty)
+{
+	// stable compaction with a read index i and a write index j, so each remaining card is moved at most once
+	is_dirty = false;
+	int j = 0;
+	for (int i = 0; i < zone.size(); i++)
 	{
-		Card* tmp_card = hand[i];
-		if (!tmp_card) // for moved cards
+		Card* tmp_card = zone[i];
+		if (!tmp_card) // for moved cards/minions
 		{
-			hand.erase(hand.begin() + i);
-			hand_size_adjust++;
+			size_adjust++;
+			continue;
 		}
 		else if (tmp_card->is_resetting) // a dying card cannot have its state reset (or affected by any effects), so if it is both resetting and dying it must be reset first, so we check for resetting first
 		{
 			tmp_card->ClearExtraEffects();
 			tmp_card->is_resetting = false; // don't forget to set it back
+			if (tmp_card->is_dying) // it is retained in this pass, so it still needs to be cleared in the next one
+				is_dirty = true;
 		}
-		else if (tmp_card->is_dying) // for transformed/cast/discarded cards
+		else if (tmp_card->is_dying) // for transformed/destroyed/cast/discarded cards/minions
 		{
+			RemoveFieldAggregates(tmp_card); // no effect if the card is not on the field
+			RemoveCardHash(tmp_card);
 			if (tmp_card->replacement) // transformed
 			{
-				hand[i] = tmp_card->replacement;
+				zone[j++] = tmp_card->replacement;
+				if (&zone == &field)
+					AddFieldAggregates(tmp_card->replacement);
+				AddCardHash(tmp_card->replacement);
 				delete tmp_card;
 			}
-			else // cast/discarded
+			else // destroyed/cast/discarded
 			{
-				hand.erase(hand.begin() + i);
 				delete tmp_card;
-				hand_size_adjust++;
+				size_adjust++;
 			}
+			continue;
 		}
+		zone[j++] = tmp_card;
 	}
+	zone.resize(j);
+}
 
-	// deck
-	for (int i = deck.size() - 1; i >= 0; i--)
+void Player::MarkZoneDirty(int card_pos)
+{
+	switch (card_pos)
 	{
-		Card* tmp_card = deck[i];
-		if (!tmp_card) // for moved cards
-		{
-			deck.erase(deck.begin() + i);
-			deck_size_adjust++;
-		}
-		else if (tmp_card->is_resetting) // a dying card cannot have its state reset (or affected by any effects), so if it is both resetting and dying it must be reset first, so we check for resetting first
-		{
-			tmp_card->ClearExtraEffects();
-			tmp_card->is_resetting = false; // don't forget to set it back
-		}
-		else if (tmp_card->is_dying) // for transformed/discarded cards
-		{
-			if (tmp_card->replacement) // transformed
-			{
-				deck[i] = tmp_card->replacement;
-				delete tmp_card;
-			}
-			else // discarded
-			{
-				deck.erase(deck.begin() + i);
-				delete tmp_card;
-				deck_size_adjust++;
-			}
-		}
+	case CARD_POS_AT_LEADER: // leader is always checked
+		break;
+	case CARD_POS_AT_FIELD:
+		is_field_dirty = true;
+		break;
+	case CARD_POS_AT_HAND:
+		is_hand_dirty = true;
+		break;
+	case CARD_POS_AT_DECK:
+		is_deck_dirty = true;
+		break;
+	default: // not sure where it is, be conservative
+		is_field_dirty = true;
+		is_hand_dirty = true;
+		is_deck_dirty = true;
+		break;
 	}
 }
 
@@ -313,9 +316,11 @@ bool Player::CheckGameEnd()
 
 void Player::FlagDestroy(Card* card, bool start_of_batch)
 {
+	EmitTraceEvent(TRACE_EVENT_DESTROY, card, nullptr, 0);
 	card->is_dying = true;
 	event_queue.push(new DestroyEvent(card, start_of_batch));
 	field_size_adjust--;
+	is_field_dirty = true;
 }
 
 void Player::FlagCastSpell(Card* card, bool start_of_batch)
@@ -323,6 +328,7 @@ void Player::FlagCastSpell(Card* card, bool start_of_batch)
 	card->is_dying = true;
 	event_queue.push(new CastEvent(card, start_of_batch));
 	hand_size_adjust--;
+	is_hand_dirty = true;
 }
 
 void Player::FlagFieldDiscard(Card* card, bool start_of_batch)
@@ -330,6 +336,7 @@ void Player::FlagFieldDiscard(Card* card, bool start_of_batch)
 	card->is_dying = true;
 	event_queue.push(new DiscardEvent(card, start_of_batch));
 	field_size_adjust--;
+	is_field_dirty = true;
 }
 
 void Player::FlagHandDiscard(Card* card, bool start_of_batch)
@@ -337,6 +344,7 @@ void Player::FlagHandDiscard(Card* card, bool start_of_batch)
 	card->is_dying = true;
 	event_queue.push(new DiscardEvent(card, start_of_batch));
 	hand_size_adjust--;
+	is_hand_dirty = true;
 }
 
 void Player::FlagDeckDiscard(Card* card, bool start_of_batch)
@@ -344,6 +352,7 @@ void Player::FlagDeckDiscard(Card* card, bool start_of_batch)
 	card->is_dying = true;
 	event_queue.push(new DiscardEvent(card, start_of_batch));
 	deck_size_adjust--;
+	is_deck_dirty = true;
 }
 
 void Player::FlagFieldSummon(Card* card, bool start_of_batch)
@@ -384,12 +393,14 @@ void Player::FlagCardTransform(Card* card, bool start_of_batch, Card* replacemen
 {
 	card->is_dying = true;
 	event_queue.push(new CardTransformEvent(card, start_of_batch, replacement));
+	MarkZoneDirty(card->card_pos);
 }
 
 void Player::FlagCardReset(Card* card, bool start_of_batch)
 {
 	card->is_resetting = true;
 	event_queue.push(new CardResetEvent(card, start_of_batch));
+	MarkZoneDirty(card->card_pos);
 }
 
 void Player::SetLose()
@@ -447,6 +458,9 @@ void Player::StartTurn()
 
 void Player::EndTurn()
 {
+	if (replay)
+		replay->RecordAction(replay_player_index, ACTION_TYPE_END_TURN, 0, 0, 0);
+
 	is_turn_active = false;
 
 	// turn ending effects
@@ -532,6 +546,9 @@ bool Player::CheckPlayValid(int x, int y, int& z)
 
 void Player::Play(int x, int y, int z)
 {
+	if (replay)
+		replay->RecordAction(replay_player_index, ACTION_TYPE_PLAY, x, y, z);
+
 	int i = x - (field.size() + opponent->field.size() + 2);
 	Card* card = hand[i];
 	
@@ -568,6 +585,9 @@ bool Player::CheckAttackValid(int x, int z)
 
 void Player::Attack(int x, int z)
 {
+	if (replay)
+		replay->RecordAction(replay_player_index, ACTION_TYPE_ATTACK, x, 0, z);
+
 	Card* card = (x == 0 ? leader : field[x - 1]);
 
 	card->Attack(x, z);
@@ -600,6 +620,7 @@ void Player::DrawCard(bool start_of_batch)
 		if (!is_exploration)
 			cout << "Suffering fatigue: " << fatigue << "." << endl << endl;
 		#endif
+		EmitTraceEvent(TRACE_EVENT_FATIGUE, leader, nullptr, fatigue);
 		leader->TakeDamage(fatigue, nullptr, true);
 		return;
 	}
@@ -610,6 +631,8 @@ void Player::DrawCard(bool start_of_batch)
 		cout << name << " draws the card " << (*it)->name << "." << endl;
 	#endif
 	Card* card = *it;
+	random_outcome_count++; // a hidden card is revealed
+	EmitTraceEvent(TRACE_EVENT_DRAW, card, nullptr, 0);
 	deck.erase(it);
 	FlagHandPut(card, start_of_batch);
 }
@@ -618,10 +641,12 @@ void Player::RecoverAttackTimes()
 {
 	leader->n_atks_loss = 0;
 	leader->is_first_turn_at_field = false;
+	leader->UpdateAggregates();
 	for (auto it = field.begin(); it != field.end(); it++)
 	{
 		(*it)->n_atks_loss = 0;
 		(*it)->is_first_turn_at_field = false;
+		(*it)->UpdateAggregates();
 	}
 }
 
@@ -789,6 +814,9 @@ Card* Player::ExtractTargetCard(int z)
 			return nullptr;
 		field[z] = nullptr;
 		field_size_adjust--;
+		RemoveFieldAggregates(target);
+		is_field_dirty = true;
+		RemoveCardHash(target);
 		return target;
 	}
 	z -= field.size();
@@ -799,6 +827,9 @@ Card* Player::ExtractTargetCard(int z)
 			return nullptr;
 		opponent->field[z] = nullptr;
 		opponent->field_size_adjust--;
+		opponent->RemoveFieldAggregates(target);
+		opponent->is_field_dirty = true;
+		opponent->RemoveCardHash(target);
 		return target;
 	}
 	z -= opponent->field.size();
@@ -812,6 +843,8 @@ Card* Player::ExtractTargetCard(int z)
 			return nullptr;
 		hand[z] = nullptr;
 		hand_size_adjust--;
+		is_hand_dirty = true;
+		RemoveCardHash(target);
 		return target;
 	}
 	z -= hand.size();
@@ -822,6 +855,8 @@ Card* Player::ExtractTargetCard(int z)
 			return nullptr;
 		deck[z] = nullptr;
 		deck_size_adjust--;
+		is_deck_dirty = true;
+		RemoveCardHash(target);
 		return target;
 	}
 	z -= deck.size();
@@ -832,6 +867,8 @@ Card* Player::ExtractTargetCard(int z)
 			return nullptr;
 		opponent->deck[z] = nullptr;
 		opponent->deck_size_adjust--;
+		opponent->is_deck_dirty = true;
+		opponent->RemoveCardHash(target);
 		return target;
 	}
 	z -= opponent->deck.size();
@@ -842,6 +879,8 @@ Card* Player::ExtractTargetCard(int z)
 			return nullptr;
 		opponent->hand[z] = nullptr;
 		opponent->hand_size_adjust--;
+		opponent->is_hand_dirty = true;
+		opponent->RemoveCardHash(target);
 		return target;
 	}
 	return nullptr;
@@ -855,6 +894,9 @@ void Player::SummonToField(Card* card)
 	card->SetAffiliation(this);
 	card->is_first_turn_at_field = true;
 	card->n_atks_loss = 0;	
+	AddFieldAggregates(card);
+	AddCardHash(card);
+	EmitTraceEvent(TRACE_EVENT_SUMMON, card, nullptr, 0);
 }
 
 void Player::PutToHand(Card* card)
@@ -865,16 +907,220 @@ void Player::PutToHand(Card* card)
 	card->SetAffiliation(this);
 	card->is_first_turn_at_field = false;
 	card->n_atks_loss = 0;
+	AddCardHash(card);
 }
 
 void Player::ShuffleToDeck(Card* card)
 {
 	int index = GetRandInt(deck.size() + 1);
+	random_outcome_count++;
 	deck.insert(deck.begin() + index, card);
 	card->card_pos = CARD_POS_AT_DECK;
 	card->SetAffiliation(this);
 	card->is_first_turn_at_field = false;
 	card->n_atks_loss = 0;
+	AddCardHash(card);
+}
+
+bool Player::DamageTargets(unsigned long long mask, int amount, Card* src, bool start_of_batch)
+{
+	// without poison or lifesteal on the source, the damage only affects the target itself, so the shield check is the only branch left
+	bool is_plain = !src->is_poisonous && !src->is_lifesteal;
+	#ifndef SUPPRESS_ALL_MSG
+	is_plain = is_plain && is_exploration && opponent->is_exploration; // the general path is needed for the messages
+	#endif
+	for (int z = 0; mask; z++, mask >>= 1)
+	{
+		if (!(mask & 1ull))
+			continue;
+		Card* target = GetTargetCard(z);
+		if (!target || target->is_dying)
+			continue;
+		if (is_plain && !target->is_shielded)
+		{
+			target->hp_loss += amount;
+			target->UpdateAggregates();
+			EmitTraceEvent(TRACE_EVENT_DAMAGE, target, src, amount);
+			if (target->hp_loss >= target->max_hp)
+				target->owner->FlagDestroy(target, start_of_batch);
+		}
+		else
+			target->TakeDamage(amount, src, start_of_batch);
+		if (target->is_dying)
+			start_of_batch = false;
+	}
+	return start_of_batch;
+}
+
+void Player::HealTargets(unsigned long long mask, int amount)
+{
+	bool is_plain = true;
+	#ifndef SUPPRESS_ALL_MSG
+	is_plain = is_exploration && opponent->is_exploration; // the general path is needed for the messages
+	#endif
+	for (int z = 0; mask; z++, mask >>= 1)
+	{
+		if (!(mask & 1ull))
+			continue;
+		Card* target = GetTargetCard(z);
+		if (!target || target->is_dying)
+			continue;
+		if (is_plain)
+		{
+			EmitTraceEvent(TRACE_EVENT_HEAL, target, nullptr, (target->hp_loss < amount ? target->hp_loss : amount));
+			target->hp_loss = (target->hp_loss < amount ? 0 : target->hp_loss - amount);
+			target->UpdateAggregates();
+		}
+		else
+			target->RestoreHp(amount);
+	}
+}
+
+void Player::AddFieldAggregates(Card* card)
+{
+	if (card->aggregate_owner) // in case it was not properly removed from another field
+		card->aggregate_owner->RemoveFieldAggregates(card);
+	card->aggregate_owner = this;
+	card->aggregate_atk = card->atk * card->max_n_atks;
+	card->aggregate_taunt_hp = card->is_taunt ? card->max_hp - card->hp_loss : 0;
+	field_atk_sum += card->aggregate_atk;
+	field_taunt_hp_sum += card->aggregate_taunt_hp;
+}
+
+void Player::RemoveFieldAggregates(Card* card)
+{
+	if (card->aggregate_owner != this)
+		return;
+	field_atk_sum -= card->aggregate_atk;
+	field_taunt_hp_sum -= card->aggregate_taunt_hp;
+	card->aggregate_owner = nullptr;
+	card->aggregate_atk = 0;
+	card->aggregate_taunt_hp = 0;
+}
+
+void Player::UpdateFieldAggregates(Card* card)
+{
+	field_atk_sum -= card->aggregate_atk;
+	field_taunt_hp_sum -= card->aggregate_taunt_hp;
+	card->aggregate_atk = card->atk * card->max_n_atks;
+	card->aggregate_taunt_hp = card->is_taunt ? card->max_hp - card->hp_loss : 0;
+	field_atk_sum += card->aggregate_atk;
+	field_taunt_hp_sum += card->aggregate_taunt_hp;
+}
+
+void Player::RecomputeAggregates()
+{
+	field_atk_sum = 0;
+	field_taunt_hp_sum = 0;
+	for (auto it = field.begin(); it != field.end(); it++)
+		if (*it) // moved minions may temperorily become nullptr
+		{
+			(*it)->aggregate_owner = nullptr;
+			AddFieldAggregates(*it);
+		}
+}
+
+void Player::AddCardHash(Card* card)
+{
+	if (card->hash_owner) // moving between players (or re-added after a position change)
+		card->hash_owner->RemoveCardHash(card);
+	card->hash_owner = this;
+	card->hash_contrib = GetCardStateHash(card);
+	cards_hash += card->hash_contrib;
+}
+
+void Player::RemoveCardHash(Card* card)
+{
+	if (card->hash_owner != this)
+		return;
+	cards_hash -= card->hash_contrib;
+	card->hash_owner = nullptr;
+	card->hash_contrib = 0;
+}
+
+void Player::UpdateCardHash(Card* card)
+{
+	cards_hash -= card->hash_contrib;
+	card->hash_contrib = GetCardStateHash(card);
+	cards_hash += card->hash_contrib;
+}
+
+void Player::RecomputeCardsHash()
+{
+	cards_hash = 0;
+	leader->hash_owner = nullptr;
+	AddCardHash(leader);
+	for (auto it = field.begin(); it != field.end(); it++)
+		if (*it) // moved cards/minions may temperorily become nullptr
+		{
+			(*it)->hash_owner = nullptr;
+			AddCardHash(*it);
+		}
+	for (auto it = hand.begin(); it != hand.end(); it++)
+		if (*it) // moved cards/minions may temperorily become nullptr
+		{
+			(*it)->hash_owner = nullptr;
+			AddCardHash(*it);
+		}
+	for (auto it = deck.begin(); it != deck.end(); it++)
+		if (*it) // moved cards/minions may temperorily become nullptr
+		{
+			(*it)->hash_owner = nullptr;
+			AddCardHash(*it);
+		}
+}
+
+unsigned long long Player::GetSideHash() const
+{
+	return FoldStatusHash(cards_hash);
+}
+
+unsigned long long Player::GetObservableSideHash(bool is_hand_visible) const
+{
+	unsigned long long h = leader->hash_contrib;
+	for (auto it = field.begin(); it != field.end(); it++)
+		if (*it) // moved cards/minions may temperorily become nullptr
+			h += (*it)->hash_contrib;
+	if (is_hand_visible)
+		for (auto it = hand.begin(); it != hand.end(); it++)
+			if (*it) // moved cards/minions may temperorily become nullptr
+				h += (*it)->hash_contrib;
+	return FoldStatusHash(h);
+}
+
+unsigned long long Player::FoldStatusHash(unsigned long long h) const
+{
+	// the status part is only a handful of scalars so it is folded in on demand rather than maintained
+	h = ZobristCombine(h, max_mp);
+	h = ZobristCombine(h, mp_loss);
+	h = ZobristCombine(h, turn_num);
+	h = ZobristCombine(h, fatigue);
+	h = ZobristCombine(h, (is_turn_active ? 1 : 0) | (is_lost ? 2 : 0));
+	h = ZobristCombine(h, GetActualFieldSize()); // the zone sizes as a second guard on the multiset of the cards
+	h = ZobristCombine(h, GetActualHandSize());
+	h = ZobristCombine(h, GetActualDeckSize());
+	return h;
+}
+
+unsigned long long Player::GetStateHash() const
+{
+	// the two sides are keyed differently so that swapping the players does not give the same hash
+	return ZobristCombine(GetSideHash(), 1) ^ ZobristCombine(opponent->GetSideHash(), 2);
+}
+
+unsigned long long Player::GetObservableStateHash() const
+{
+	return ZobristCombine(GetObservableSideHash(true), 1) ^ ZobristCombine(opponent->GetObservableSideHash(false), 2);
+}
+
+int Player::GetEffectiveAtk() const
+{
+	return leader->atk * leader->max_n_atks + field_atk_sum;
+}
+
+int Player::GetTauntHpPool() const
+{
+	return leader->is_taunt ? 0 : field_taunt_hp_sum; // minion only contribute to effective hp if it has taunt (and the leader does not)
 }
 
 double Player::GetHeuristicEval() const
@@ -895,33 +1141,21 @@ double Player::GetHeuristicEval() const
 			bool almost_win = false;
 			bool almost_lose = false;
 
-			// collect ally strength information
-			int effective_ally_atk = leader->atk * leader->max_n_atks;
+			// collect ally strength information (field contributions come from the running aggregates)
+			int effective_ally_atk = GetEffectiveAtk();
 			int effective_ally_hp = leader->max_hp - leader->hp_loss; // note this is mostly considering leader's hp
 			if (deck.empty() && turn_num < MAX_NUM_TURNS) // if we don't have next turn then we don't need to consider fatigue (it is possible the game has not ended yet as the opponent may still has a turn)
 				effective_ally_hp -= fatigue;
-			for (auto it = field.begin(); it != field.end(); it++)
-			{
-				Card* tmp_minion = *it;
-				effective_ally_atk += tmp_minion->atk * tmp_minion->max_n_atks;
-				if (!leader->is_taunt && tmp_minion->is_taunt) // minion only contribute to effective hp if it has taunt (and the leader does not)
-					effective_ally_hp += tmp_minion->max_hp - tmp_minion->hp_loss;
-			}
+			effective_ally_hp += GetTauntHpPool();
 			
-			// collect opponent strength information
-			int effective_oppo_atk = opponent->leader->atk * opponent->leader->max_n_atks;
+			// collect opponent strength information (field contributions come from the running aggregates)
+			int effective_oppo_atk = opponent->GetEffectiveAtk();
 			int effective_oppo_hp = opponent->leader->max_hp - opponent->leader->hp_loss; // note this is mostly considering leader's hp
 			if (opponent->deck.empty()) // do not need to check for max turn number because if opponent has completed the last turn then at this point the game would have already ended in a draw (we only use the heuristic as end of turn evaluation) 
 				effective_oppo_hp -= opponent->fatigue;
 			if (effective_oppo_hp <= 0) // opponent will first take the next fatigure damage so this is ALMOST a gauranteed win (not 100% as turn start effects triggers before card draw, and there can also be divine shield on leaders etc.)
 				almost_win = true;
-			for (auto it = opponent->field.begin(); it != opponent->field.end(); it++)
-			{
-				Card* tmp_minion = *it;
-				effective_oppo_atk += tmp_minion->atk * tmp_minion->max_n_atks;
-				if (!opponent->leader->is_taunt && tmp_minion->is_taunt) // minion only contribute to effective hp if it has taunt (and the leader does not)
-					effective_oppo_hp += tmp_minion->max_hp - tmp_minion->hp_loss;
-			}
+			effective_oppo_hp += opponent->GetTauntHpPool();
 
 			// opponent will attack next turn (and then allied leader suffers fatigue) so this will be a check point for a potentially ALMOST gauranteed loss
 			if (effective_ally_hp <= effective_oppo_atk)
@@ -968,6 +1202,21 @@ double Player::GetHeuristicEval() const
 	}
 }
 
+bool Player::IsPlacementIrrelevant(Card* card) const
+{
+	if (card->card_type != MINION_CARD) // leader cards replace the leader and spells are not placed at all
+		return true;
+
+	// there are no adjacency mechanics, the position only decides the order the minion is visited relative to other minions on the field (for turn start/end triggers, AoE etc.)
+	// the order only matters if both the minion and some other minion on the field can trigger effects, otherwise the relative order of the effect triggering cards is the same for all positions
+	if (!card->HasEffects())
+		return true;
+	for (auto it = field.begin(); it != field.end(); it++)
+		if (*it && (*it)->HasEffects())
+			return false;
+	return true;
+}
+
 vector<ActionSetEntity*> Player::GetOptionSet()
 {
 	vector<ActionSetEntity*> option_set;
@@ -1000,23 +1249,197 @@ vector<ActionSetEntity*> Player::GetOptionSet()
 	return option_set;
 }
 
+int Player::EnumerateActions(CompactAction* buffer, int capacity, int* option_starts, int& num_options)
+{
+	int n = 0;
+	num_options = 0;
+	int hand_start = field.size() + opponent->field.size() + 2;
+	int num_targets = field.size() + opponent->field.size() + hand.size() + 2;
+
+	// possible play actions, the valid targets of each card are computed once in a single pass as a bitmask
+	for (int i = 0; i < hand.size(); i++)
+	{
+		int x = hand_start + i;
+		Card* tmp_card = hand[i];
+		int option_start = n;
+
+		if (CheckMP(tmp_card->mana))
+		{
+			if (tmp_card->card_type == SPELL_CARD)
+			{
+				if (tmp_card->isTargetedAtPlay(x, -1))
+				{
+					unsigned long long mask = tmp_card->GetPlayTargetMask(x, -1); // no valid target means the spell cannot be played
+					for (int z = 0; z < num_targets && n < capacity; z++)
+						if (mask & (1ull << z))
+							buffer[n++] = mkPlayAction(x, -1, z);
+				}
+				else if (n < capacity)
+					buffer[n++] = mkPlayAction(x, -1, -1);
+			}
+			else if (tmp_card->card_type == LEADER_CARD || GetActualFieldSize() < MAX_FIELD_SIZE)
+			{
+				unsigned long long mask = tmp_card->GetPlayTargetMask(x, 0); // no valid target means the battlecry becomes untargeted
+				int min_y = (IsPlacementIrrelevant(tmp_card) ? field.size() : 0); // collapse to the canonical position if possible
+				for (int y = min_y; y <= field.size(); y++)
+				{
+					if (mask)
+					{
+						for (int z = 0; z < num_targets && n < capacity; z++)
+							if (mask & (1ull << z))
+								buffer[n++] = mkPlayAction(x, y, z);
+					}
+					else if (n < capacity)
+						buffer[n++] = mkPlayAction(x, y, -1);
+				}
+			}
+		}
+
+		if (n > option_start)
+			option_starts[num_options++] = option_start;
+	}
+
+	// possible attack actions
+	for (int x = 0; x <= field.size(); x++)
+	{
+		int option_start = n;
+		for (int z = field.size() + 1; z <= field.size() + opponent->field.size() + 1 && n < capacity; z++)
+			if (CheckAttackValid(x, z))
+				buffer[n++] = mkAttackAction(x, z);
+
+		if (n > option_start)
+			option_starts[num_options++] = option_start;
+	}
+
+	// end turn action, which is always an option
+	if (n < capacity)
+	{
+		option_starts[num_options++] = n;
+		buffer[n++] = mkEndTurnAction();
+	}
+	option_starts[num_options] = n;
+
+	return n;
+}
+
+bool Player::CheckCompactActionValid(const CompactAction& action)
+{
+	int tmp_des = action.des; // CheckPlayValid may modify the destination to -1 if it is untargeted
+	switch (action.type)
+	{
+	case ACTION_TYPE_PLAY:
+		return CheckPlayValid(action.src, action.pos, tmp_des);
+	case ACTION_TYPE_ATTACK:
+		return CheckAttackValid(action.src, action.des);
+	default:
+		return true;
+	}
+}
+
+void Player::PerformCompactAction(const CompactAction& action)
+{
+	switch (action.type)
+	{
+	case ACTION_TYPE_PLAY:
+		Play(action.src, action.pos, action.des);
+		break;
+	case ACTION_TYPE_ATTACK:
+		Attack(action.src, action.des);
+		break;
+	default:
+		EndTurn();
+		break;
+	}
+}
+
 void Player::TakeSearchAIInputs()
 {
+	bool is_shared_tree = (parallel_search_mode == PARALLEL_SEARCH_TREE && num_search_workers != 1); // the nodes of the turn tree cannot be shared between the workers
+	TurnSearchNode* search_root = (use_turn_search_tree && root_policy == ROOT_POLICY_UCB && !use_turn_plan && !is_shared_tree ? new TurnSearchNode() : nullptr); // the sequential halving policies search every decision from scratch
+	vector<CompactAction> plan;
+	int plan_pos = 0;
+	KnowledgeState* knowledge_state = nullptr;
+	queue<DeferredEvent*> knowledge_event_queue;
+	chrono::steady_clock::time_point turn_deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(search_time_per_turn));
 	while (is_turn_active)
-		TakeSearchAIInput();
+	{
+		SearchTimeBudget time_budget;
+		time_budget.has_deadline = false;
+		time_budget.is_anytime = false;
+		if (search_time_per_decision > 0.0)
+		{
+			time_budget.has_deadline = true;
+			time_budget.is_anytime = true;
+			time_budget.deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(search_time_per_decision));
+		}
+		if (search_time_per_turn > 0.0)
+		{
+			if (chrono::steady_clock::now() >= turn_deadline) // out of time for the turn
+			{
+				TakeRandomAIInputs();
+				break;
+			}
+			if (!time_budget.has_deadline || turn_deadline < time_budget.deadline)
+				time_budget.deadline = turn_deadline;
+			time_budget.has_deadline = true;
+		}
+		if (use_turn_plan)
+			TakePlannedAIInput(plan, plan_pos, time_budget);
+		else
+			TakeSearchAIInput(knowledge_state, knowledge_event_queue, search_root, time_budget);
+	}
+	delete search_root;
+	delete knowledge_state;
+	while (!knowledge_event_queue.empty())
+	{
+		delete knowledge_event_queue.front(); // note: this is not deleting the actual card but the entity for flagging
+		knowledge_event_queue.pop();
+	}
 }
 
-void Player::TakeSearchAIInput()
+void Player::TakePlannedAIInput(vector<CompactAction>& plan, int& plan_pos, const SearchTimeBudget& time_budget)
 {
-	queue<DeferredEvent*> event_queue;
-	PtrRedirMap redir_map;
-	KnowledgeState knowledge_state(this, event_queue, redir_map);
-	knowledge_state.PerformAction();
+	if (plan_pos >= plan.size() || !CheckCompactActionValid(plan[plan_pos])) // (re)plan
+	{
+		queue<DeferredEvent*> event_queue;
+		PtrRedirMap redir_map;
+		KnowledgeState knowledge_state(this, event_queue, redir_map);
+		knowledge_state.SetTimeBudget(time_budget);
+		knowledge_state.SearchTurnPlan(plan);
+		plan_pos = 0;
 
-	while (!event_queue.empty())
+		while (!event_queue.empty())
+		{
+			delete event_queue.front(); // note: this is not deleting the actual card but the entity for flagging
+			event_queue.pop();
+		}
+	}
+
+	unsigned long long init_random_outcome_count = random_outcome_count;
+	PerformCompactAction(plan[plan_pos++]);
+	if (random_outcome_count != init_random_outcome_count) // the outcome may not be the simulated one, so the rest of the plan is stale
+		plan.clear();
+}
+
+void Player::TakeSearchAIInput(KnowledgeState*& knowledge_state, queue<DeferredEvent*>& knowledge_event_queue, TurnSearchNode*& search_root, const SearchTimeBudget& time_budget)
+{
+	if (!knowledge_state) // a new determinization, only needed at the start of the turn or after an action with a random outcome
 	{
-		delete event_queue.front(); // note: this is not deleting the actual card but the entity for flagging
-		event_queue.pop();
+		PtrRedirMap redir_map;
+		knowledge_state = new KnowledgeState(this, knowledge_event_queue, redir_map);
+	}
+
+	knowledge_state->SetTimeBudget(time_budget);
+	bool is_kept = (search_root ? knowledge_state->PerformTreeAction(search_root) : knowledge_state->PerformAction());
+	if (!is_kept)
+	{
+		delete knowledge_state;
+		knowledge_state = nullptr;
+		while (!knowledge_event_queue.empty())
+		{
+			delete knowledge_event_queue.front(); // note: this is not deleting the actual card but the entity for flagging
+			knowledge_event_queue.pop();
+		}
 	}
 }
 
@@ -1026,28 +1449,158 @@ void Player::TakeRandomAIInputs()
 		TakeRandomAIInput();
 }
 
-void Player::TakeRandomAIInput()
+map<unsigned long long, LookaheadCacheEntry> lookahead_cache; // by the observable state hash at the end of the searching player's turn
+
+void Player::TakeLookaheadInputs()
 {
-	vector<ActionSetEntity*> option_set = GetOptionSet();
+	for (int i = 0; i < LOOKAHEAD_MAX_ACTIONS_PER_TURN && is_turn_active; i++)
+		TakeRolloutInput();
+	if (is_turn_active)
+		EndTurn();
+}
 
-	int i = GetRandInt(option_set.size());
-	option_set[i]->PerformRandomAction(this);
+double Player::GetLookaheadEval()
+{
+	if (search_lookahead_depth <= 0 || CheckLose() || opponent->CheckLose())
+		return GetHeuristicEval();
 
-	for (auto it = option_set.begin(); it != option_set.end(); it++)
-		delete (*it);
+	// the average of a state that has enough samples stands in for playing the turns again; keyed by what this player can observe, so the samples of the same state under different hidden cards are pooled (an estimate over the information set)
+	SearchStats& stats = GetSearchStats();
+	stats.num_lookahead_evals++;
+	unsigned long long state_hash = GetObservableStateHash();
+	auto it = lookahead_cache.find(state_hash);
+	if (it != lookahead_cache.end() && it->second.num_samples >= LOOKAHEAD_CACHE_MAX_SAMPLES)
+	{
+		stats.num_lookahead_cache_hits++;
+		return it->second.sum_eval / (double)it->second.num_samples;
+	}
+
+	// play the following turns (the opponent's first) and evaluate from the side that ended the last one
+	Player* side = this;
+	for (int d = 0; d < search_lookahead_depth && !CheckLose() && !opponent->CheckLose(); d++)
+	{
+		side = side->opponent;
+		side->StartTurn();
+		if (side->is_turn_active)
+			side->TakeLookaheadInputs();
+	}
+	double tmp_eval = (side == this ? GetHeuristicEval() : -side->GetHeuristicEval());
+
+	LookaheadCacheEntry& entry = lookahead_cache[state_hash];
+	entry.num_samples++;
+	entry.sum_eval += tmp_eval;
+	return tmp_eval;
 }
 
-void Player::TakeInputs()
+void ClearLookaheadCache()
+{
+	lookahead_cache.clear();
+}
+
+void Player::TakeRandomAIInput()
+{
+	CompactAction action_buffer[MAX_NUM_COMPACT_ACTIONS];
+	int option_starts[MAX_NUM_OPTIONS + 1];
+	int num_options;
+	EnumerateActions(action_buffer, MAX_NUM_COMPACT_ACTIONS, option_starts, num_options);
+
+	// uniformly choose an option first and then an action inside it (same distribution as choosing from GetOptionSet)
+	int i = GetRandInt(num_options);
+	int j = GetRandInt(option_starts[i + 1] - option_starts[i]);
+	PerformCompactAction(action_buffer[option_starts[i] + j]);
+}
+
+void Player::TakeRolloutInputs()
 {
 	while (is_turn_active)
-		TakeSingleInput();
+		TakeRolloutInput();
 }
 
-void Player::TakeSingleInput()
+void Player::TakeRolloutInput()
 {
-	char command_ch;
-	
-	bool valid_type_found = false;
+	if (rollout_policy == ROLLOUT_POLICY_GREEDY)
+		TakeGreedyAIInput();
+	else
+		TakeRandomAIInput();
+}
+
+void Player::TakeGreedyAIInput()
+{
+	CompactAction action_buffer[MAX_NUM_COMPACT_ACTIONS];
+	int option_starts[MAX_NUM_OPTIONS + 1];
+	int num_options;
+	int num_actions = EnumerateActions(action_buffer, MAX_NUM_COMPACT_ACTIONS, option_starts, num_options);
+
+	if (GetRandFloat() < GREEDY_ROLLOUT_EPSILON) // explore, same distribution as the random policy
+	{
+		int i = GetRandInt(num_options);
+		int j = GetRandInt(option_starts[i + 1] - option_starts[i]);
+		PerformCompactAction(action_buffer[option_starts[i] + j]);
+		return;
+	}
+
+	// the best scoring action, ties broken uniformly
+	int selected_index = 0;
+	double best_score = -1e10;
+	int num_ties = 0;
+	for (int i = 0; i < num_actions; i++)
+	{
+		double tmp_score = GetGreedyActionScore(action_buffer[i]);
+		if (tmp_score > best_score)
+		{
+			best_score = tmp_score;
+			selected_index = i;
+			num_ties = 1;
+		}
+		else if (tmp_score == best_score && GetRandInt(++num_ties) == 0)
+			selected_index = i;
+	}
+	PerformCompactAction(action_buffer[selected_index]);
+}
+
+double Player::GetGreedyActionScore(const CompactAction& action) const
+{
+	switch (action.type)
+	{
+	case ACTION_TYPE_PLAY: // spend the mana, bigger cards first
+		return 1.0 + GetTargetCard(action.src)->mana;
+	case ACTION_TYPE_ATTACK:
+		{
+			Card* attacker = GetTargetCard(action.src);
+			Card* target = GetTargetCard(action.des);
+			if (target == opponent->leader) // go face
+				return attacker->atk;
+
+			// trade: worth the value of the target if it dies, minus the value of the attacker if it dies too
+			int attacker_hp = attacker->max_hp - attacker->hp_loss;
+			int target_hp = target->max_hp - target->hp_loss;
+			bool is_target_killed = !target->is_shielded && attacker->atk > 0 && (attacker->atk >= target_hp || attacker->is_poisonous);
+			bool is_attacker_killed = !attacker->is_shielded && target->atk > 0 && (target->atk >= attacker_hp || target->is_poisonous);
+			double score = 0.0;
+			if (is_target_killed)
+				score += target->atk + target_hp;
+			if (is_attacker_killed)
+				score -= (attacker == leader ? GREEDY_LEADER_VALUE : attacker->atk + attacker_hp);
+			if (!is_target_killed)
+				score -= 1.0; // chip damage is not worth more than going face or ending the turn
+			return score;
+		}
+	default: // end turn only when nothing better is left
+		return 0.0;
+	}
+}
+
+void Player::TakeInputs()
+{
+	while (is_turn_active)
+		TakeSingleInput();
+}
+
+void Player::TakeSingleInput()
+{
+	char command_ch;
+	
+	bool valid_type_found = false;
 	
 	int x, y, z;
 	while (!valid_type_found)
@@ -1233,64 +1786,205 @@ int Player::GetActualDeckSize() const
 }
 
 
-/* Generator/Descriptor Section */
+unsigned long long ZobristMix(unsigned long long x)
+{
+	x += 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
 
+unsigned long long ZobristCombine(unsigned long long h, long long val)
+{
+	return ZobristMix(h ^ ZobristMix((unsigned long long)val));
+}
 
-void IntersectRange(int& min_result, int& max_result, int min1, int max1, int min2, int max2)
+string CardName::Render() const
 {
-	min_result = (min2 > min1 ? min2 : min1);
-	max_result = (max2 < max1 ? max2 : max1);
+	string tmp_str;
+	int i = 0;
+	switch (origin)
+	{
+	case NAME_ORIGIN_SEED:
+		tmp_str = "#" + IntToStr(seeds[i++]);
+		break;
+	case NAME_ORIGIN_DEFAULT_LEADER:
+		tmp_str = "Default Leader";
+		break;
+	case NAME_ORIGIN_SND_PLAYER_TOKEN:
+		tmp_str = "Second Player Token";
+		break;
+	default:
+		break;
+	}
+
+	int n = (chain_len < MAX_NAME_CHAIN_LEN ? chain_len : MAX_NAME_CHAIN_LEN);
+	for (; i < n; i++)
+	{
+		if (i == MAX_NAME_CHAIN_LEN - 1 && chain_len > MAX_NAME_CHAIN_LEN)
+			tmp_str += "_Spawn_..."; // the middle part of an overly long chain is dropped
+		tmp_str += "_Spawn_#" + IntToStr(seeds[i]);
+	}
+	return tmp_str;
 }
 
-void IntersectRangeInPlace(int& min_val, int& max_val, int other_min_val, int other_max_val)
+CardName mkFixedName(int origin)
 {
-	if (other_min_val > min_val)
-		min_val = other_min_val;
-	if (other_max_val < max_val)
-		max_val = other_max_val;
+	CardName name;
+	name.origin = origin;
+	name.chain_len = 0;
+	name.key = ZobristMix(origin) | 1ull;
+	return name;
 }
 
-void UnionRangeInPlace(int& min_val, int& max_val, int other_min_val, int other_max_val)
+CardName mkSeedName(int seed)
 {
-	if (other_min_val < min_val)
-		min_val = other_min_val;
-	if (other_max_val > max_val)
-		max_val = other_max_val;
+	CardName name = mkFixedName(NAME_ORIGIN_SEED);
+	name.seeds[name.chain_len++] = seed;
+	name.key = ZobristCombine(name.key, seed) | 1ull;
+	return name;
+}
+
+CardName mkSpawnName(const CardName& parent, int seed)
+{
+	CardName name = parent;
+	if (name.chain_len < MAX_NAME_CHAIN_LEN)
+		name.seeds[name.chain_len] = seed;
+	else
+		name.seeds[MAX_NAME_CHAIN_LEN - 1] = seed; // keep the last one
+	name.chain_len++;
+	name.key = ZobristCombine(name.key, seed) | 1ull;
+	return name;
+}
+
+ostream& operator<<(ostream& os, const CardName& name)
+{
+	return os << name.Render();
+}
+
+int GetNthSetBit(unsigned long long mask, int n)
+{
+	for (int i = 0; mask; i++, mask >>= 1)
+		if ((mask & 1ull) && n-- == 0)
+			return i;
+	return -1;
+}
+
+unsigned long long GetCardIdentityKey(Card* card)
+{
+	return card->name.key;
+}
+
+unsigned long long GetCardStateHash(Card* card)
+{
+	unsigned long long h = GetCardIdentityKey(card);
+	h = ZobristCombine(h, card->card_pos);
+	h = ZobristCombine(h, card->card_type);
+	h = ZobristCombine(h, card->mana);
+	h = ZobristCombine(h, card->atk);
+	h = ZobristCombine(h, card->max_hp);
+	h = ZobristCombine(h, card->hp_loss);
+	h = ZobristCombine(h, card->max_n_atks);
+	h = ZobristCombine(h, card->n_atks_loss);
+	h = ZobristCombine(h, card->minion_type);
+	h = ZobristCombine(h, (card->is_charge ? 0x1 : 0) | (card->is_taunt ? 0x2 : 0) | (card->is_stealth ? 0x4 : 0) | (card->is_untargetable ? 0x8 : 0)
+						| (card->is_shielded ? 0x10 : 0) | (card->is_poisonous ? 0x20 : 0) | (card->is_lifesteal ? 0x40 : 0)
+						| (card->is_first_turn_at_field ? 0x80 : 0)); // is_dying/is_resetting are transient flags cleared before any state is evaluated, so they are not included
+	h = ZobristCombine(h, card->overheat_count_digest);
+	h = ZobristCombine(h, card->overheat_threshold_digest);
+	h = ZobristCombine(h, card->effects_extra.size());
+	return h;
+}
+
+
+/* Generator/Descriptor Section */
+
+
+EffectProgram::EffectProgram()
+{
+	for (int t = 0; t <= NUM_TRIGGER_TYPES; t++)
+		offsets[t] = 0;
+	for (int t = 0; t < NUM_TRIGGER_TYPES; t++)
+		lead_syncs[t] = false;
 }
 
+void EffectProgram::BeginLeaf(int trigger_type)
+{
+	leaf_starts.push_back(leaf_code.size());
+	leaf_triggers.push_back(trigger_type);
+}
 
-CondConfig::CondConfig(unsigned _flag, int _min_mp, int _max_mp, int _min_max_mp, int _max_max_mp, int _min_cost, int _max_cost, int _min_atk, int _max_atk, int _min_hp, int _max_hp, int _min_n_atks, int _max_n_atks)
-	: flag(_flag), min_mp(_min_mp), max_mp(_max_mp), min_max_mp(_min_max_mp), max_max_mp(_max_max_mp), min_cost(_min_cost), max_cost(_max_cost), min_atk(_min_atk), max_atk(_max_atk), min_hp(_min_hp), max_hp(_max_hp), min_n_atks(_min_n_atks), max_n_atks(_max_n_atks)
+int EffectProgram::Emit(int op, int val, void* node, void* aux)
 {
+	EffectInstr instr;
+	instr.op = op;
+	instr.val = val;
+	instr.jump = 0;
+	instr.node = node;
+	instr.aux = aux;
+	leaf_code.push_back(instr);
+	return leaf_code.size() - 1;
 }
 
-CondConfig::CondConfig(unsigned _flag, int _min_cost, int _max_cost, int _min_atk, int _max_atk, int _min_hp, int _max_hp, int _min_n_atks, int _max_n_atks)
-	: CondConfig(_flag, 0, 10, 0, 10, _min_cost, _max_cost, _min_atk, _max_atk, _min_hp, _max_hp, _min_n_atks, _max_n_atks)
+void EffectProgram::PatchJump(int index)
 {
+	leaf_code[index].jump = leaf_code.size() - leaf_starts.back();
 }
 
-CondConfig::CondConfig(unsigned _flag)
-	: CondConfig(_flag, 0, 10, 0, 10, -9, 40, 0, 5)
+void EffectProgram::Finalize()
 {
-	if (!(_flag & TARGET_IS_SPELL))
+	// the chain processes deferred events after every effect, and consecutive processing with nothing in between is the same as processing once (the second one finds the queue empty and the game end status unchanged), so only the blocks responding to a trigger need to be kept, plus one leading processing if the first effect does not respond
+	int n = leaf_triggers.size();
+	leaf_starts.push_back(leaf_code.size());
+	EffectInstr sync_instr = {EFFECT_OP_SYNC, 0, 0, nullptr, nullptr};
+	code.clear();
+	for (int t = 0; t < NUM_TRIGGER_TYPES; t++)
 	{
-		// if it is referring to a character and considers minions or only allowing minions then the upper bound for HP become lower
-		if (_flag & TARGET_IS_MINION)
-		{
-			if (_flag & TARGET_IS_LEADER)
-				max_hp = 20;
-			else
-				max_hp = 10;
-		}
+		offsets[t] = code.size();
+		lead_syncs[t] = (n > 0 && leaf_triggers[0] != t);
+		for (int i = 0; i < n; i++)
+			if (leaf_triggers[i] == t)
+			{
+				int block_start = code.size();
+				for (int j = leaf_starts[i]; j < leaf_starts[i + 1]; j++)
+				{
+					EffectInstr instr = leaf_code[j];
+					instr.jump += block_start; // a check that fails lands on the sync after the block
+					code.push_back(instr);
+				}
+				code.push_back(sync_instr);
+			}
 	}
+	offsets[NUM_TRIGGER_TYPES] = code.size();
+	leaf_code.clear();
+	leaf_starts.clear();
+	leaf_triggers.clear();
+}
+
+void IntersectRange(int& min_result, int& max_result, int min1, int max1, int min2, int max2)
+{
+	min_result = (min2 > min1 ? min2 : min1);
+	max_result = (max2 < max1 ? max2 : max1);
+}
+
+void IntersectRangeInPlace(int& min_val, int& max_val, int other_min_val, int other_max_val)
+{
+	if (other_min_val > min_val)
+		min_val = other_min_val;
+	if (other_max_val < max_val)
+		max_val = other_max_val;
 }
 
-CondConfig::CondConfig()
-	: CondConfig(TARGET_TYPE_ANY, 0, 10, 0, 10, -9, 40, 0, 5)  // -9 is taking into consideration of on destroy (deathrattle) timing
+void UnionRangeInPlace(int& min_val, int& max_val, int other_min_val, int other_max_val)
 {
+	if (other_min_val < min_val)
+		min_val = other_min_val;
+	if (other_max_val > max_val)
+		max_val = other_max_val;
 }
 
-CondConfig CondConfig::operator &= (const CondConfig& config)
+
+CondConfig& CondConfig::operator &= (const CondConfig& config)
 {
 	flag &= config.flag;
 	IntersectRangeInPlace(min_mp, max_mp, config.min_mp, config.max_mp);
@@ -1303,14 +1997,14 @@ CondConfig CondConfig::operator &= (const CondConfig& config)
 	return *this;
 }
 
-CondConfig CondConfig::operator &= (unsigned flag)
+CondConfig& CondConfig::operator &= (unsigned flag)
 {
 	this->flag &= flag;
 
 	return *this;
 }
 
-CondConfig CondConfig::operator |= (const CondConfig & config)
+CondConfig& CondConfig::operator |= (const CondConfig & config)
 {
 	UnionRangeInPlace(min_mp, max_mp, config.min_mp, config.max_mp);
 	UnionRangeInPlace(min_max_mp, max_max_mp, config.min_max_mp, config.max_max_mp);
@@ -1322,23 +2016,13 @@ CondConfig CondConfig::operator |= (const CondConfig & config)
 	return *this;
 }
 
-CondConfig CondConfig::operator |= (unsigned flag)
+CondConfig& CondConfig::operator |= (unsigned flag)
 {
 	this->flag |= flag;
 
 	return *this;
 }
 
-unsigned CondConfig::operator&(unsigned mask) const
-{
-	return flag & mask;
-}
-
-unsigned CondConfig::operator|(unsigned mask) const
-{
-	return flag | mask;
-}
-
 CondConfig GetInitConfigFromCard(const Card* card)
 {
 	unsigned card_pos_flag = TARGET_ANY_POS_TYPE;
@@ -1387,12 +2071,12 @@ CondConfig ExtractEffectIndependentConfig(const CondConfig& config)
 
 CondConfig GetDefaultInitConfig()
 {
-	return CondConfig(TARGET_ANY_POS_TYPE | TARGET_ANY_CARD_ALLE_MINION_TYPE);
+	return DEFAULT_INIT_COND_CONFIG;
 }
 
 CondConfig GetDefaultConfig()
 {
-	return CondConfig();
+	return DEFAULT_COND_CONFIG;
 }
 
 CondConfig GetFlagConfig(unsigned flag)
@@ -1432,6 +2116,7 @@ CondConfig GetAtkTimesConfig(unsigned flag, int min_n_atks, int max_n_atks)
 
 
 bool display_overheat_counts = false;
+bool use_effect_programs = true;
 
 
 string MinionTypeDescription(int type)
@@ -1538,9 +2223,21 @@ vector<int> CreateRandomSelectionSorted(int n, int k)
 
 Card* GenerateSingleCard(int seed)
 {
+	AllocPoolScope pool_scope;
 	return GenerateCard(seed);
 }
 
+Card* SampleHiddenCard()
+{
+	static vector<Card*> pool; // filled on the first call and kept for the rest of the process (inherited by the search workers)
+	if (pool.empty())
+		for (int i = 0; i < HIDDEN_CARD_POOL_SIZE; i++)
+			pool.push_back(GenerateCard(GetRandInt()));
+
+	PtrRedirMap redir_map;
+	return pool[GetRandInt(HIDDEN_CARD_POOL_SIZE)]->CreateHardCopy(redir_map);
+}
+
 string GetCardBrief(Card* card)
 {
 	return card->BriefInfo();
@@ -1660,6 +2357,74 @@ void DeleteCard(Card * card)
 	delete card;
 }
 
+bool is_trace_enabled = false;
+string trace_path_prefix;
+atomic<int> trace_thread_count(0);
+
+TraceBuffer::TraceBuffer() : size(0), fs()
+{
+}
+
+TraceBuffer::~TraceBuffer()
+{
+	Flush();
+}
+
+void TraceBuffer::Push(const TraceEvent& event)
+{
+	events[size++] = event;
+	if (size >= TRACE_BUFFER_SIZE)
+		Flush();
+}
+
+void TraceBuffer::Flush()
+{
+	if (size <= 0)
+		return;
+	if (!fs.is_open())
+	{
+		fs.open(trace_path_prefix + "_" + IntToStr(trace_thread_count++) + ".bin", ios::binary);
+		unsigned magic = TRACE_MAGIC;
+		int version = TRACE_VERSION;
+		fs.write((const char*)&magic, sizeof(magic));
+		fs.write((const char*)&version, sizeof(version));
+	}
+	fs.write((const char*)events, size * sizeof(TraceEvent));
+	size = 0;
+}
+
+TraceBuffer& GetTraceBuffer()
+{
+	static thread_local TraceBuffer buffer;
+	return buffer;
+}
+
+void EnableTrace(const string& path_prefix)
+{
+	trace_path_prefix = path_prefix;
+	is_trace_enabled = true;
+}
+
+void FlushTrace()
+{
+	GetTraceBuffer().Flush();
+}
+
+void RecordTraceEvent(unsigned type, Card* card, Card* src, int amount)
+{
+	if (card->owner && card->owner->is_exploration)
+		return;
+
+	TraceEvent event;
+	event.card_id = GetCardIdentityKey(card);
+	event.src_id = (src ? GetCardIdentityKey(src) : 0);
+	event.amount = amount;
+	event.turn_num = (card->owner ? card->owner->turn_num : 0);
+	event.card_pos = card->card_pos;
+	event.type = type;
+	GetTraceBuffer().Push(event);
+}
+
 
 DeferredEvent::DeferredEvent(Card* _card, bool _start_of_batch) : card(_card), is_start_of_batch(_start_of_batch)
 {
@@ -1788,113 +2553,431 @@ void CardResetEvent::Process(Player* curr_player)
 }
 
 
-/* AI Section */
+/* Memory Section */
 
 
-ActionEntity::ActionEntity()
+bool use_alloc_pools = true;
+
+struct PoolFreeLists
 {
-}
+	~PoolFreeLists();
+	void* heads[POOL_NUM_SIZE_CLASSES]; // singly linked through the first word of each free block (after the header)
+	int num_blocks[POOL_NUM_SIZE_CLASSES];
+	int thread_id; // 0 until the thread first pools a block
+	int scope_depth;
+	bool is_drained; // set at the thread exit, blocks freed afterwards (by the destructors of other thread locals) go to free
+};
 
-PlayAction::PlayAction(int _src, int _pos, int _des) : src(_src), pos(_pos), des(_des)
+thread_local PoolFreeLists pool_free_lists;
+thread_local AllocCounts alloc_counts;
+atomic<int> pool_num_threads(0);
+
+PoolFreeLists::~PoolFreeLists()
 {
+	for (int i = 0; i < POOL_NUM_SIZE_CLASSES; i++)
+		while (heads[i])
+		{
+			void* block = heads[i];
+			heads[i] = *(void**)block;
+			free((char*)block - POOL_BLOCK_HEADER_SIZE);
+		}
+	is_drained = true;
 }
 
-bool PlayAction::CheckValid(Player* player) const
+AllocCounts GetAllocCounts()
 {
-	int tmp_des = des; // CheckPlayValid may modify the destination to -1 if it is untargeted, this is only meaningful for human console input, AI will check if it is Targeted before hand
-	return player->CheckPlayValid(src, pos, tmp_des);
+	return alloc_counts;
 }
 
-void PlayAction::PerformAction(Player* player) const
+AllocPoolScope::AllocPoolScope()
 {
-	player->Play(src, pos, des);
+	pool_free_lists.scope_depth++;
 }
 
-AttackAction::AttackAction(int _src, int _des) : src(_src), des(_des)
+AllocPoolScope::~AllocPoolScope()
 {
+	pool_free_lists.scope_depth--;
 }
 
-bool AttackAction::CheckValid(Player* player) const
+void* operator new(size_t size)
 {
-	return player->CheckAttackValid(src, des);
+	alloc_counts.num_news++;
+
+	PoolFreeLists& lists = pool_free_lists;
+	int size_class = -1; // not pooled
+	if (use_alloc_pools && lists.scope_depth > 0 && !lists.is_drained && size <= POOL_NUM_SIZE_CLASSES * POOL_SIZE_CLASS_GRANULARITY)
+	{
+		size_class = (size == 0 ? 0 : (size - 1) / POOL_SIZE_CLASS_GRANULARITY);
+		size = (size_class + 1) * POOL_SIZE_CLASS_GRANULARITY; // round up so that the block can be reused for the whole class
+		void* block = lists.heads[size_class];
+		if (block)
+		{
+			lists.heads[size_class] = *(void**)block;
+			lists.num_blocks[size_class]--;
+			memset(block, 0, size); // reset on reuse, the new object never sees the previous one (nor the free list link)
+			return block;
+		}
+		if (lists.thread_id == 0)
+			lists.thread_id = ++pool_num_threads;
+	}
+
+	alloc_counts.num_sys_allocs++;
+	char* raw = (char*)malloc(size + POOL_BLOCK_HEADER_SIZE);
+	if (!raw)
+		throw bad_alloc();
+	((int*)raw)[0] = size_class;
+	((int*)raw)[1] = (size_class >= 0 ? lists.thread_id : 0);
+	return raw + POOL_BLOCK_HEADER_SIZE;
 }
 
-void AttackAction::PerformAction(Player* player) const
+void operator delete(void* ptr) noexcept
 {
-	player->Attack(src, des);
+	if (!ptr)
+		return;
+
+	char* raw = (char*)ptr - POOL_BLOCK_HEADER_SIZE;
+	int size_class = ((int*)raw)[0];
+	PoolFreeLists& lists = pool_free_lists;
+	if (size_class >= 0 && use_alloc_pools && !lists.is_drained && ((int*)raw)[1] == lists.thread_id && lists.num_blocks[size_class] < POOL_MAX_FREE_BLOCKS)
+	{
+		*(void**)ptr = lists.heads[size_class];
+		lists.heads[size_class] = ptr;
+		lists.num_blocks[size_class]++;
+	}
+	else
+		free(raw);
 }
 
-EndTurnAction::EndTurnAction()
-{
+
+/* AI Section */
+
+
+bool use_turn_search_tree = true;
+int num_search_workers = 1;
+int parallel_search_mode = PARALLEL_SEARCH_ROOT;
+int default_root_policy = ROOT_POLICY_UCB;
+int default_rollout_policy = ROLLOUT_POLICY_RANDOM;
+double search_time_per_decision = 0.0;
+double search_time_per_turn = 0.0;
+bool use_turn_plan = false;
+unsigned long long random_outcome_count = 0;
+bool use_ismcts = false;
+int search_lookahead_depth = 0;
+bool use_early_stopping = false;
+double early_stopping_delta = 0.05;
+SearchStats search_stats = {0, 0, 0, 0, 0};
+
+CompactAction mkPlayAction(int src, int pos, int des)
+{
+	CompactAction action;
+	action.type = ACTION_TYPE_PLAY;
+	action.src = src;
+	action.pos = pos;
+	action.des = des;
+	return action;
 }
 
-bool EndTurnAction::CheckValid(Player* player) const
+CompactAction mkAttackAction(int src, int des)
 {
-	return true;
+	CompactAction action;
+	action.type = ACTION_TYPE_ATTACK;
+	action.src = src;
+	action.pos = -1;
+	action.des = des;
+	return action;
 }
 
-void EndTurnAction::PerformAction(Player* player) const
+CompactAction mkEndTurnAction()
 {
-	player->EndTurn();
+	CompactAction action;
+	action.type = ACTION_TYPE_END_TURN;
+	action.src = -1;
+	action.pos = -1;
+	action.des = -1;
+	return action;
 }
 
-ActionSetEntity::ActionSetEntity() : action_set()
+bool IsSameCompactAction(const CompactAction& action1, const CompactAction& action2)
 {
+	return action1.type == action2.type && action1.src == action2.src && action1.pos == action2.pos && action1.des == action2.des;
 }
 
-ActionSetEntity::~ActionSetEntity()
+void AddSharedEval(atomic<double>& sum_eval, double val)
 {
-	for (auto it = action_set.begin(); it != action_set.end(); it++)
-		delete (*it);
+	double old_val = sum_eval.load();
+	while (!sum_eval.compare_exchange_weak(old_val, old_val + val)); // old_val is refreshed on failure
 }
 
-PlayActionSet::PlayActionSet(int _card_index) : card_index(_card_index)
+int SelectSharedArm(const SharedArmStats* arms, int num_arms, int parent_visits)
 {
+	int selected_index = 0;
+	double max_priority_weight = -1e10;
+	double two_ln_visits = 2.0 * log(parent_visits > 1 ? parent_visits : 1);
+	for (int i = 0; i < num_arms; i++)
+	{
+		int tmp_visits = arms[i].num_visits.load();
+		if (tmp_visits == 0)
+			return i;
+
+		double tmp_eval = arms[i].sum_eval.load() / (double)tmp_visits;
+		double tmp_weight = tmp_eval + 2.0 * sqrt(two_ln_visits / (double)tmp_visits); // UCB-1, the 2.0 is for scalling up for range -1 ~ 1 as opposed to 0 ~ 1
+		if (tmp_weight > max_priority_weight)
+		{
+			max_priority_weight = tmp_weight;
+			selected_index = i;
+		}
+	}
+
+	return selected_index;
 }
 
-int PlayActionSet::CreateValidSet(Player* player)
+bool IsDecisionClear(const vector<ActionStats>& stats, double delta)
 {
-	if (card_index <= player->field.size() + player->opponent->field.size() + 1 || card_index > player->field.size() + player->opponent->field.size() + player->hand.size() + 1)
-		return 0;
+	int n = stats.size();
+	if (n < 2)
+		return true;
 
-	int x = card_index - (player->field.size() + player->opponent->field.size() + 2);
-	Card* tmp_card = player->hand[x];
+	// bounds hold simultaneously with probability 1 - delta (union bound over the actions)
+	double log_term = log(3.0 * n / delta);
+	vector<double> lower_bounds(n), upper_bounds(n);
+	int best_index = -1;
+	for (int i = 0; i < n; i++)
+	{
+		int tmp_visits = stats[i].num_visits;
+		if (tmp_visits < EARLY_STOP_MIN_VISITS)
+			return false;
+		double tmp_ave = stats[i].sum_eval / (double)tmp_visits;
+		double tmp_var = stats[i].sum_sq_eval / (double)tmp_visits - tmp_ave * tmp_ave;
+		if (tmp_var < 0.0)
+			tmp_var = 0.0;
+		double tmp_radius = sqrt(2.0 * tmp_var * log_term / (double)tmp_visits) + 3.0 * 2.0 * log_term / (double)tmp_visits; // empirical Bernstein, the 2.0 is the range of the evaluation
+		lower_bounds[i] = tmp_ave - tmp_radius;
+		upper_bounds[i] = tmp_ave + tmp_radius;
+		if (best_index < 0 || tmp_ave > stats[best_index].sum_eval / (double)stats[best_index].num_visits)
+			best_index = i;
+	}
 
-	if (tmp_card->card_type == SPELL_CARD)
+	for (int i = 0; i < n; i++)
+		if (i != best_index && upper_bounds[i] >= lower_bounds[best_index])
+			return false;
+
+	return true;
+}
+
+SearchStats& GetSearchStats()
+{
+	return search_stats;
+}
+
+void RunForkedWorkers(int first_worker, int num_workers, const function<bool(int, FILE*)>& write_share, const function<void()>& run_here, const function<bool(int, FILE*)>& read_share, const function<void(int)>& run_share_here)
+{
+	vector<FILE*> worker_files(num_workers, nullptr);
+	vector<pid_t> worker_pids(num_workers, -1);
+	cout.flush(); // so that the pending output is not written again by the workers
+	for (int w = first_worker; w < num_workers; w++)
 	{
-		if (tmp_card->isTargetedAtPlay(card_index, -1))
+		worker_files[w] = tmpfile();
+		worker_pids[w] = (worker_files[w] ? fork() : -1);
+		if (worker_pids[w] == 0) // worker: write its share to its file
 		{
-			for (int i = 0; i <= player->field.size() + player->opponent->field.size() + player->hand.size() + 1; i++)
+			bool is_ok;
+			try
 			{
-				PlayAction* tmp_action = new PlayAction(card_index, -1, i);
-				if (tmp_action->CheckValid(player))
-					action_set.push_back(tmp_action);
-				else
-					delete tmp_action;
+				is_ok = write_share(w, worker_files[w]);
 			}
-		}
-		else
-		{
-			PlayAction* tmp_action = new PlayAction(card_index, -1, -1);
-			if (tmp_action->CheckValid(player))
-				action_set.push_back(tmp_action);
-			else
-				delete tmp_action;
+			catch (...) // never let an exception unwind into the parent's code in the worker
+			{
+				is_ok = false;
+			}
+			_exit(is_ok && fflush(worker_files[w]) == 0 ? 0 : 1); // skip the destructors and exit handlers of the parent's state (buffered output streams in particular)
 		}
 	}
-	else
+
+	run_here();
+
+	for (int w = first_worker; w < num_workers; w++)
 	{
-		for (int j = 0; j <= player->field.size(); j++)
+		int status = 0;
+		bool is_ok = (worker_pids[w] > 0 && waitpid(worker_pids[w], &status, 0) == worker_pids[w] && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		if (is_ok)
 		{
+			rewind(worker_files[w]);
+			is_ok = read_share(w, worker_files[w]);
+		}
 
-			if (tmp_card->isTargetedAtPlay(card_index, j))
-			{
-				for (int i = 0; i <= player->field.size() + player->opponent->field.size() + player->hand.size() + 1; i++)
-				{
-					PlayAction* tmp_action = new PlayAction(card_index, j, i);
-					if (tmp_action->CheckValid(player))
-						action_set.push_back(tmp_action);
-					else
+		if (!is_ok) // the worker failed (or could not be started), run its share here
+		{
+			#ifndef SUPPRESS_ALL_MSG
+			cout << "Worker " << w << " failed, running its share serially." << endl;
+			#endif
+			run_share_here(w);
+		}
+
+		if (worker_files[w])
+			fclose(worker_files[w]);
+	}
+}
+
+int RunParallelTests(int total_num_tests, int num_workers, const function<int(int)>& run_tests, const function<void(vector<ActionStats>&)>& get_stats, const function<void(const vector<ActionStats>&)>& add_stats)
+{
+	if (num_workers <= 0)
+		num_workers = thread::hardware_concurrency();
+	if (num_workers > total_num_tests)
+		num_workers = total_num_tests;
+	if (num_workers <= 1 || is_torch_initialized) // forking is not safe once torch is initialized
+		return run_tests(total_num_tests);
+
+	// the current process is worker 0, the others are forked (as the random generator of GIGL is global, each worker needs its own process for its own stream)
+	vector<int> worker_seeds(num_workers);
+	for (int w = 1; w < num_workers; w++)
+		worker_seeds[w] = GetRandInt();
+	auto get_share = [&](int w) { return (int)((long long)total_num_tests * (w + 1) / num_workers - (long long)total_num_tests * w / num_workers); };
+
+	int total_num_tests_saved = 0;
+	RunForkedWorkers(1, num_workers,
+		[&](int w, FILE* fp) // run the share and write the change of the statistics
+		{
+			vector<ActionStats> init_stats, stats;
+			RandInit(worker_seeds[w]);
+			get_stats(init_stats);
+			int num_tests_saved = run_tests(get_share(w));
+			get_stats(stats);
+
+			int n = stats.size();
+			for (int i = 0; i < n; i++)
+			{
+				stats[i].num_visits -= init_stats[i].num_visits;
+				stats[i].sum_eval -= init_stats[i].sum_eval;
+				stats[i].sum_sq_eval -= init_stats[i].sum_sq_eval;
+			}
+			fwrite(&n, sizeof(int), 1, fp);
+			fwrite(stats.data(), sizeof(ActionStats), n, fp);
+			fwrite(&num_tests_saved, sizeof(int), 1, fp);
+			return true;
+		},
+		[&]() { total_num_tests_saved += run_tests(get_share(0)); },
+		[&](int w, FILE* fp)
+		{
+			int n, num_tests_saved;
+			if (fread(&n, sizeof(int), 1, fp) != 1)
+				return false;
+			vector<ActionStats> stats(n);
+			if (fread(stats.data(), sizeof(ActionStats), n, fp) != (size_t)n || fread(&num_tests_saved, sizeof(int), 1, fp) != 1)
+				return false;
+			add_stats(stats);
+			total_num_tests_saved += num_tests_saved;
+			return true;
+		},
+		[&](int w) { total_num_tests_saved += run_tests(get_share(w)); });
+
+	return total_num_tests_saved;
+}
+
+ActionEntity::ActionEntity()
+{
+}
+
+PlayAction::PlayAction(int _src, int _pos, int _des) : src(_src), pos(_pos), des(_des)
+{
+}
+
+bool PlayAction::CheckValid(Player* player) const
+{
+	int tmp_des = des; // CheckPlayValid may modify the destination to -1 if it is untargeted, this is only meaningful for human console input, AI will check if it is Targeted before hand
+	return player->CheckPlayValid(src, pos, tmp_des);
+}
+
+void PlayAction::PerformAction(Player* player) const
+{
+	player->Play(src, pos, des);
+}
+
+AttackAction::AttackAction(int _src, int _des) : src(_src), des(_des)
+{
+}
+
+bool AttackAction::CheckValid(Player* player) const
+{
+	return player->CheckAttackValid(src, des);
+}
+
+void AttackAction::PerformAction(Player* player) const
+{
+	player->Attack(src, des);
+}
+
+EndTurnAction::EndTurnAction()
+{
+}
+
+bool EndTurnAction::CheckValid(Player* player) const
+{
+	return true;
+}
+
+void EndTurnAction::PerformAction(Player* player) const
+{
+	player->EndTurn();
+}
+
+ActionSetEntity::ActionSetEntity() : action_set()
+{
+}
+
+ActionSetEntity::~ActionSetEntity()
+{
+	for (auto it = action_set.begin(); it != action_set.end(); it++)
+		delete (*it);
+}
+
+PlayActionSet::PlayActionSet(int _card_index) : card_index(_card_index)
+{
+}
+
+int PlayActionSet::CreateValidSet(Player* player)
+{
+	if (card_index <= player->field.size() + player->opponent->field.size() + 1 || card_index > player->field.size() + player->opponent->field.size() + player->hand.size() + 1)
+		return 0;
+
+	int x = card_index - (player->field.size() + player->opponent->field.size() + 2);
+	Card* tmp_card = player->hand[x];
+
+	if (tmp_card->card_type == SPELL_CARD)
+	{
+		if (tmp_card->isTargetedAtPlay(card_index, -1))
+		{
+			for (int i = 0; i <= player->field.size() + player->opponent->field.size() + player->hand.size() + 1; i++)
+			{
+				PlayAction* tmp_action = new PlayAction(card_index, -1, i);
+				if (tmp_action->CheckValid(player))
+					action_set.push_back(tmp_action);
+				else
+					delete tmp_action;
+			}
+		}
+		else
+		{
+			PlayAction* tmp_action = new PlayAction(card_index, -1, -1);
+			if (tmp_action->CheckValid(player))
+				action_set.push_back(tmp_action);
+			else
+				delete tmp_action;
+		}
+	}
+	else
+	{
+		int min_j = (player->IsPlacementIrrelevant(tmp_card) ? player->field.size() : 0); // collapse to the canonical position if possible
+		for (int j = min_j; j <= player->field.size(); j++)
+		{
+
+			if (tmp_card->isTargetedAtPlay(card_index, j))
+			{
+				for (int i = 0; i <= player->field.size() + player->opponent->field.size() + player->hand.size() + 1; i++)
+				{
+					PlayAction* tmp_action = new PlayAction(card_index, j, i);
+					if (tmp_action->CheckValid(player))
+						action_set.push_back(tmp_action);
+					else
 						delete tmp_action;
 				}
 			}
@@ -1917,293 +3000,1066 @@ int PlayActionSet::RecheckValidity(Player* player)
 	// well there are more efficient algorithms to delete multiple entries but we expect this to rarely happen
 	for (int i = action_set.size() - 1; i >= 0; i--) // note erasing when looping with iterators is more error prone
 	{
-		if (!action_set[i]->CheckValid(player))
-			action_set.erase(action_set.begin() + i);
+		if (!action_set[i]->CheckValid(player))
+			action_set.erase(action_set.begin() + i);
+	}
+
+	return action_set.size();
+}
+
+void PlayActionSet::PerformRandomAction(Player* player) const
+{
+	int i = GetRandInt(action_set.size());
+	action_set[i]->PerformAction(player);
+}
+
+AttackActionSet::AttackActionSet(int _card_index) : card_index(_card_index)
+{
+}
+
+int AttackActionSet::CreateValidSet(Player* player)
+{
+	if (card_index < 0 || card_index > player->field.size())
+		return 0;
+
+	for (int i = player->field.size() + 1; i <= player->field.size() + player->opponent->field.size() + 1; i++)
+	{
+		AttackAction* tmp_action = new AttackAction(card_index, i);
+		if (tmp_action->CheckValid(player))
+			action_set.push_back(tmp_action);
+		else
+			delete tmp_action;
+	}
+
+	return action_set.size();
+}
+
+int AttackActionSet::RecheckValidity(Player* player)
+{
+	// well there are more efficient algorithms to delete multiple entries but we expect this to rarely happen
+	for (int i = action_set.size() - 1; i >= 0; i--) // note erasing when looping with iterators is more error prone 
+	{
+		if (!action_set[i]->CheckValid(player))
+			action_set.erase(action_set.begin() + i);
+	}
+
+	return action_set.size();
+}
+
+void AttackActionSet::PerformRandomAction(Player* player) const
+{
+	int i = GetRandInt(action_set.size());
+	action_set[i]->PerformAction(player);
+}
+
+EndTurnActionSet::EndTurnActionSet()
+{
+}
+
+int EndTurnActionSet::CreateValidSet(Player* player)
+{
+	action_set.push_back(new EndTurnAction());
+	return 1;
+}
+
+int EndTurnActionSet::RecheckValidity(Player* player)
+{
+	return 1;
+}
+
+void EndTurnActionSet::PerformRandomAction(Player* player) const
+{
+	action_set[0]->PerformAction(player);
+}
+
+
+KnowledgeActionNode::KnowledgeActionNode(const CompactAction& _action) : num_visits(0), sum_eval(0.0), sum_sq_eval(0.0), ave_eval(0.0), action(_action)
+{
+}
+
+const CompactAction* KnowledgeActionNode::GetAction() const
+{
+	return &action;
+}
+
+double KnowledgeActionNode::TestAction(Player* player)
+{
+	player->PerformCompactAction(action);
+	if (player->is_turn_active)
+		player->TakeRolloutInputs();
+	num_visits++;
+	double tmp_eval = player->GetLookaheadEval();
+	sum_eval += tmp_eval;
+	sum_sq_eval += tmp_eval * tmp_eval;
+	ave_eval = sum_eval / (double)num_visits;
+	return tmp_eval;
+}
+
+KnowledgeOptionNode::KnowledgeOptionNode(const CompactAction* actions, int num_actions) : num_visits(0), sum_eval(0.0), ave_eval(0.0), action_nodes()
+{
+	for (int i = 0; i < num_actions; i++)
+		action_nodes.push_back(new KnowledgeActionNode(actions[i]));
+}
+
+KnowledgeOptionNode::~KnowledgeOptionNode()
+{
+	for (auto it = action_nodes.begin(); it != action_nodes.end(); it++)
+		delete (*it);
+}
+
+const KnowledgeActionNode* KnowledgeOptionNode::GetOptimalActionNode() const
+{
+	double best_eval = -1e10;
+	const KnowledgeActionNode* best_node = nullptr;
+
+	for (auto it = action_nodes.begin(); it != action_nodes.end(); it++)
+	{
+		const KnowledgeActionNode* tmp_node = (*it);
+		double tmp_eval = tmp_node->ave_eval;
+		if (tmp_eval > best_eval)
+		{
+			best_eval = tmp_eval;
+			best_node = tmp_node;
+		}
+	}
+
+	return best_node;
+}
+
+const KnowledgeActionNode* KnowledgeOptionNode::GetActionNode(int index) const
+{
+	return action_nodes[index];
+}
+
+void KnowledgeOptionNode::GetActionStats(vector<ActionStats>& stats) const
+{
+	for (auto it = action_nodes.begin(); it != action_nodes.end(); it++)
+	{
+		ActionStats tmp_stats;
+		tmp_stats.num_visits = (*it)->num_visits;
+		tmp_stats.sum_eval = (*it)->sum_eval;
+		tmp_stats.sum_sq_eval = (*it)->sum_sq_eval;
+		stats.push_back(tmp_stats);
+	}
+}
+
+int KnowledgeOptionNode::AddActionStats(const vector<ActionStats>& stats, int start)
+{
+	for (auto it = action_nodes.begin(); it != action_nodes.end(); it++, start++)
+	{
+		KnowledgeActionNode* tmp_node = (*it);
+		if (stats[start].num_visits == 0)
+			continue;
+		tmp_node->num_visits += stats[start].num_visits;
+		tmp_node->sum_eval += stats[start].sum_eval;
+		tmp_node->sum_sq_eval += stats[start].sum_sq_eval;
+		tmp_node->ave_eval = tmp_node->sum_eval / (double)tmp_node->num_visits;
+		num_visits += stats[start].num_visits;
+		sum_eval += stats[start].sum_eval;
+	}
+	if (num_visits > 0)
+		ave_eval = sum_eval / (double)num_visits;
+
+	return start;
+}
+
+double KnowledgeOptionNode::TestAction(Player* player)
+{
+	KnowledgeActionNode* selected_node = nullptr;
+
+	// first see if there is any unvisited child
+	auto it = action_nodes.begin();
+	while (it != action_nodes.end() && (*it)->num_visits > 0)
+		it++;
+	// if not then it should be at the "end()" at this point, we do UCB-1 for a mult-armed bandit choice; if so then the "it" should be pointing to the first unvisited child at this point, we choose that node
+	if (it == action_nodes.end())
+	{
+		double max_priority_weight = -1e10;
+		double two_ln_visits = 2.0 * log(num_visits);
+		for (it = action_nodes.begin(); it != action_nodes.end(); it++)
+		{
+			KnowledgeActionNode* tmp_node = (*it);
+			int tmp_visits = tmp_node->num_visits;
+			if (tmp_visits == 0)
+			{
+				selected_node = tmp_node;
+				break;
+			}
+
+			double tmp_eval = tmp_node->ave_eval;
+			double tmp_weight = tmp_eval + 2.0 * sqrt(two_ln_visits / (double)tmp_visits); // UCB-1, the 2.0 is for scalling up for range -1 ~ 1 as opposed to 0 ~ 1
+			if (tmp_weight > max_priority_weight)
+			{
+				max_priority_weight = tmp_weight;
+				selected_node = tmp_node;
+			}
+		}
+	}
+	else
+		selected_node = (*it);
+
+	num_visits++;
+	double tmp_eval = selected_node->TestAction(player);
+	sum_eval += tmp_eval;
+	ave_eval = sum_eval / (double)num_visits;
+	return tmp_eval;
+}
+
+double KnowledgeOptionNode::TestActionAt(Player* player, int index)
+{
+	num_visits++;
+	double tmp_eval = action_nodes[index]->TestAction(player);
+	sum_eval += tmp_eval;
+	ave_eval = sum_eval / (double)num_visits;
+	return tmp_eval;
+}
+
+KnowledgeState::KnowledgeState(Player* _player, queue<DeferredEvent*>& event_queue, PtrRedirMap& redir_map) : num_visits(0), option_nodes(), valid_actions(), valid_option_starts(1, 0), num_tests_scaling(_player->ai_level), root_policy(_player->root_policy), time_budget(), orig_player(_player), ally_player(_player->CreateKnowledgeCopy(COPY_ALLY, event_queue, redir_map)), oppo_player(_player->opponent->CreateKnowledgeCopy(COPY_OPPO, event_queue, redir_map))
+{
+	ally_player->opponent = oppo_player;
+	oppo_player->opponent = ally_player;
+	ally_player->SetAllCardAfflications();
+	oppo_player->SetAllCardAfflications();
+	oppo_player->rollout_policy = _player->rollout_policy; // the opponent is played with our own rollout policy
+	EnumerateValidActions();
+}
+
+void KnowledgeState::EnumerateValidActions()
+{
+	for (auto it = option_nodes.begin(); it != option_nodes.end(); it++)
+		delete (*it);
+	option_nodes.clear();
+	valid_actions.clear();
+	valid_option_starts.assign(1, 0);
+	num_visits = 0;
+	ClearLookaheadCache(); // the states cached for the previous decision are unlikely to come up again
+
+	CompactAction action_buffer[MAX_NUM_COMPACT_ACTIONS];
+	int option_starts[MAX_NUM_OPTIONS + 1];
+	int num_options;
+	orig_player->EnumerateActions(action_buffer, MAX_NUM_COMPACT_ACTIONS, option_starts, num_options);
+
+	// re-check if each action is still in the knowledge copy, if not remove (this is a relatively native solution, it guarentees not broken by only considering actions that are valid in both truth state and knowledge state)
+	num_actions = 0;
+	for (int i = 0; i < num_options; i++)
+	{
+		// compact the valid actions of the option to the front of its own range
+		int num_valid = 0;
+		for (int j = option_starts[i]; j < option_starts[i + 1]; j++)
+			if (ally_player->CheckCompactActionValid(action_buffer[j]))
+				action_buffer[option_starts[i] + num_valid++] = action_buffer[j];
+		if (num_valid > 0)
+		{
+			option_nodes.push_back(new KnowledgeOptionNode(action_buffer + option_starts[i], num_valid));
+			valid_actions.insert(valid_actions.end(), action_buffer + option_starts[i], action_buffer + option_starts[i] + num_valid);
+			num_actions += num_valid;
+			valid_option_starts.push_back(num_actions);
+		}
+	}
+}
+
+KnowledgeState::~KnowledgeState()
+{
+	for (auto it = option_nodes.begin(); it != option_nodes.end(); it++)
+		delete (*it);
+
+	// note: don't delete the orig_player as it is managed in the actual game
+	delete ally_player;
+	delete oppo_player;
+}
+
+const CompactAction* KnowledgeState::GetOptimalAction() const
+{
+	double best_eval = -1e10;
+	const CompactAction* best_action = nullptr;
+	
+	for (auto it = option_nodes.begin(); it != option_nodes.end(); it++)
+	{
+		const KnowledgeActionNode* tmp_best_node = (*it)->GetOptimalActionNode();
+		double tmp_best_eval = tmp_best_node->ave_eval;
+		if (tmp_best_eval > best_eval)
+		{
+			best_eval = tmp_best_eval;
+			best_action = tmp_best_node->GetAction();
+		}
+	}
+
+	return best_action;
+}
+
+double KnowledgeState::TestAction(Player* player)
+{
+	KnowledgeOptionNode* selected_node = nullptr;
+
+	// first see if there is any unvisited child
+	auto it = option_nodes.begin();
+	while (it != option_nodes.end() && (*it)->num_visits > 0)
+		it++;
+	// if not then it should be at the "end()" at this point, we do UCB-1 for a mult-armed bandit choice; if so then the "it" should be pointing to the first unvisited child at this point, we choose that node
+	if (it == option_nodes.end())
+	{
+		double max_priority_weight = -1e10;
+		double two_ln_visits = 2.0 * log(num_visits);
+		for (it = option_nodes.begin(); it != option_nodes.end(); it++)
+		{
+			KnowledgeOptionNode* tmp_node = (*it);
+			int tmp_visits = tmp_node->num_visits;
+			if (tmp_visits == 0)
+			{
+				selected_node = tmp_node;
+				break;
+			}
+
+			double tmp_eval = tmp_node->ave_eval;
+			double tmp_weight = tmp_eval + 2.0 * sqrt(two_ln_visits / (double)tmp_visits); // UCB-1, the 2.0 is for scalling up for range -1 ~ 1 as opposed to 0 ~ 1
+			if (tmp_weight > max_priority_weight)
+			{
+				max_priority_weight = tmp_weight;
+				selected_node = tmp_node;
+			}
+		}
+	}
+	else
+		selected_node = (*it);
+
+	num_visits++;
+	double tmp_eval = selected_node->TestAction(player);
+	return tmp_eval;
+}
+
+void KnowledgeState::SetTimeBudget(const SearchTimeBudget& _time_budget)
+{
+	time_budget = _time_budget;
+}
+
+bool KnowledgeState::IsOutOfTime() const
+{
+	return time_budget.has_deadline && chrono::steady_clock::now() >= time_budget.deadline;
+}
+
+bool KnowledgeState::PerformAction()
+{
+	// search/test
+	int total_num_tests = (num_actions - 1) * num_tests_scaling; // subtract one because if there were only one action there is no need to test
+	if (time_budget.is_anytime)
+		total_num_tests = (num_actions > 1 ? MAX_ANYTIME_NUM_TESTS : 0);
+	int init_visits = num_visits;
+	int num_tests_saved = 0;
+	const CompactAction* action;
+	if (root_policy != ROOT_POLICY_UCB && !time_budget.is_anytime && num_actions > 1)
+		action = RunSequentialHalving(total_num_tests);
+	else
+	{
+		if (parallel_search_mode == PARALLEL_SEARCH_TREE && num_search_workers != 1)
+			num_tests_saved = RunSharedTreeTests(total_num_tests, num_search_workers);
+		else
+			num_tests_saved = RunParallelTests(total_num_tests, num_search_workers,
+				[this](int num_tests) { return RunTests(num_tests); },
+				[this](vector<ActionStats>& stats) { GetActionStats(stats); },
+				[this](const vector<ActionStats>& stats) { AddActionStats(stats); });
+		action = GetOptimalAction();
+	}
+	RecordSearchStats(total_num_tests, num_visits - init_visits, num_tests_saved);
+
+	// execute the optimal action
+	return ExecuteAction(*action);
+}
+
+bool KnowledgeState::ExecuteAction(CompactAction action)
+{
+	unsigned long long init_random_outcome_count = random_outcome_count;
+	orig_player->PerformCompactAction(action);
+	if (!orig_player->is_turn_active || random_outcome_count != init_random_outcome_count)
+		return false;
+
+	ally_player->PerformCompactAction(action);
+	if (!ally_player->is_turn_active) // should not happen with a deterministic outcome, but the hidden cards of the copies may still differ
+		return false;
+	EnumerateValidActions();
+	return true;
+}
+
+void KnowledgeState::RecordSearchStats(int total_num_tests, int num_tests_used, int num_tests_saved) const
+{
+	if (total_num_tests <= 0)
+		return;
+	search_stats.num_decisions++;
+	search_stats.num_rollouts += num_tests_used;
+	search_stats.num_rollouts_saved += num_tests_saved;
+}
+
+bool KnowledgeState::IsEarlyStopCheck(int num_tests_done) const
+{
+	return use_early_stopping && !time_budget.is_anytime && num_tests_done % EARLY_STOP_CHECK_INTERVAL == 0;
+}
+
+int KnowledgeState::RunTests(int num_tests)
+{
+	vector<ActionStats> stats;
+	for (int i = 0; i < num_tests && !IsOutOfTime(); i++)
+	{
+		if (i > 0 && IsEarlyStopCheck(i))
+		{
+			GetActionStats(stats);
+			if (IsDecisionClear(stats, early_stopping_delta))
+				return num_tests - i;
+		}
+		RunSingleTest([this](Player* player) { return TestAction(player); });
+	}
+
+	return 0;
+}
+
+double KnowledgeState::RunSingleTest(const function<double(Player*)>& test_action)
+{
+	// in ISMCTS every rollout resamples the hidden cards (from the pool) instead of reusing the ones sampled for the knowledge state
+	AllocPoolScope pool_scope;
+	queue<DeferredEvent*> event_queue;
+	PtrRedirMap redir_map;
+	Player* ally_copy = ally_player->CreateKnowledgeCopy(use_ismcts ? COPY_ALLY : COPY_EXACT, event_queue, redir_map);
+	Player* oppo_copy = oppo_player->CreateKnowledgeCopy(use_ismcts ? COPY_OPPO : COPY_EXACT, event_queue, redir_map);
+	ally_copy->opponent = oppo_copy;
+	oppo_copy->opponent = ally_copy;
+	ally_copy->SetAllCardAfflications();
+	oppo_copy->SetAllCardAfflications();
+	double tmp_eval = test_action(ally_copy);
+	while (!event_queue.empty())
+	{
+		delete event_queue.front(); // note: this is not deleting the actual card but the entity for flagging
+		event_queue.pop();
+	}
+	delete ally_copy;
+	delete oppo_copy;
+	return tmp_eval;
+}
+
+const CompactAction* KnowledgeState::RunSequentialHalving(int total_num_tests)
+{
+	bool is_option_arms = (root_policy == ROOT_POLICY_SEQ_HALVING_OPTIONS);
+	int num_arms = (is_option_arms ? (int)option_nodes.size() : num_actions);
+	vector<int> arms(num_arms);
+	for (int i = 0; i < num_arms; i++)
+		arms[i] = i;
+	int num_rounds = 0;
+	for (int k = 1; k < num_arms; k *= 2)
+		num_rounds++;
+
+	auto is_better_arm = [&](int arm1, int arm2) { return GetArmEval(arm1, is_option_arms) > GetArmEval(arm2, is_option_arms); };
+	for (int r = 0; r < num_rounds && arms.size() > 1 && !IsOutOfTime(); r++)
+	{
+		int num_arm_tests = max(1, total_num_tests / (num_rounds * (int)arms.size())); // every remaining arm is tested at least once per round even if the budget is short
+		RunParallelTests(num_arm_tests * arms.size(), num_search_workers,
+			[&](int num_tests) { RunArmTests(num_tests, arms, is_option_arms); return 0; },
+			[this](vector<ActionStats>& stats) { GetActionStats(stats); },
+			[this](const vector<ActionStats>& stats) { AddActionStats(stats); });
+
+		// keep the better half
+		stable_sort(arms.begin(), arms.end(), is_better_arm);
+		arms.resize((arms.size() + 1) / 2);
+	}
+	stable_sort(arms.begin(), arms.end(), is_better_arm); // in case the deadline cut the rounds short
+
+	if (is_option_arms)
+		return option_nodes[arms[0]]->GetOptimalActionNode()->GetAction();
+	return &valid_actions[arms[0]];
+}
+
+void KnowledgeState::RunArmTests(int num_tests, const vector<int>& arms, bool is_option_arms)
+{
+	int num_arms = arms.size();
+	int start = GetRandInt(num_arms); // so that the shares of the workers do not all favor the first arms
+	for (int i = 0; i < num_tests && !IsOutOfTime(); i++)
+	{
+		int arm = arms[(start + i) % num_arms];
+		num_visits++;
+		if (is_option_arms)
+			RunSingleTest([&](Player* player) { return option_nodes[arm]->TestAction(player); });
+		else
+		{
+			int option_index = upper_bound(valid_option_starts.begin(), valid_option_starts.end(), arm) - valid_option_starts.begin() - 1;
+			RunSingleTest([&](Player* player) { return option_nodes[option_index]->TestActionAt(player, arm - valid_option_starts[option_index]); });
+		}
+	}
+}
+
+double KnowledgeState::GetArmEval(int arm, bool is_option_arms) const
+{
+	if (is_option_arms)
+		return option_nodes[arm]->GetOptimalActionNode()->ave_eval;
+	return GetActionNode(arm)->ave_eval;
+}
+
+const KnowledgeActionNode* KnowledgeState::GetActionNode(int action_index) const
+{
+	int option_index = upper_bound(valid_option_starts.begin(), valid_option_starts.end(), action_index) - valid_option_starts.begin() - 1;
+	return option_nodes[option_index]->GetActionNode(action_index - valid_option_starts[option_index]);
+}
+
+void KnowledgeState::GetActionStats(vector<ActionStats>& stats) const
+{
+	stats.clear();
+	for (auto it = option_nodes.begin(); it != option_nodes.end(); it++)
+		(*it)->GetActionStats(stats);
+}
+
+void KnowledgeState::AddActionStats(const vector<ActionStats>& stats)
+{
+	int start = 0;
+	for (auto it = option_nodes.begin(); it != option_nodes.end(); it++)
+	{
+		int end = (*it)->AddActionStats(stats, start);
+		for (int i = start; i < end; i++)
+			num_visits += stats[i].num_visits;
+		start = end;
+	}
+}
+
+int KnowledgeState::RunSharedTreeTests(int total_num_tests, int num_workers)
+{
+	int num_options = option_nodes.size();
+	size_t region_size = sizeof(atomic<int>) + (num_options + num_actions) * sizeof(SharedArmStats);
+	void* region = mmap(nullptr, region_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED) // fall back to root parallelization
+		return RunParallelTests(total_num_tests, num_workers,
+			[this](int num_tests) { return RunTests(num_tests); },
+			[this](vector<ActionStats>& stats) { GetActionStats(stats); },
+			[this](const vector<ActionStats>& stats) { AddActionStats(stats); });
+
+	// lay out the shared statistics, starting from the current ones
+	vector<ActionStats> init_stats;
+	GetActionStats(init_stats);
+	atomic<int>* root_visits = new (region) atomic<int>(num_visits);
+	SharedArmStats* option_stats = (SharedArmStats*)((char*)region + sizeof(atomic<int>));
+	SharedArmStats* action_stats = option_stats + num_options;
+	for (int i = 0; i < num_options; i++)
+	{
+		new (&option_stats[i].num_visits) atomic<int>(option_nodes[i]->num_visits);
+		new (&option_stats[i].sum_eval) atomic<double>(option_nodes[i]->sum_eval);
+		new (&option_stats[i].sum_sq_eval) atomic<double>(0.0); // not used for options
+	}
+	for (int i = 0; i < num_actions; i++)
+	{
+		new (&action_stats[i].num_visits) atomic<int>(init_stats[i].num_visits);
+		new (&action_stats[i].sum_eval) atomic<double>(init_stats[i].sum_eval);
+		new (&action_stats[i].sum_sq_eval) atomic<double>(init_stats[i].sum_sq_eval);
+	}
+
+	// the workers only report whether they finished, the statistics are already in the shared region
+	try
+	{
+		RunParallelTests(total_num_tests, num_workers,
+			[&](int num_tests) { RunSharedTests(num_tests, root_visits, option_stats, action_stats); return 0; },
+			[](vector<ActionStats>& stats) { stats.clear(); },
+			[](const vector<ActionStats>& stats) {});
+	}
+	catch (...)
+	{
+		munmap(region, region_size);
+		throw;
+	}
+
+	vector<ActionStats> stats(num_actions);
+	for (int i = 0; i < num_actions; i++)
+	{
+		stats[i].num_visits = action_stats[i].num_visits.load() - init_stats[i].num_visits;
+		stats[i].sum_eval = action_stats[i].sum_eval.load() - init_stats[i].sum_eval;
+		stats[i].sum_sq_eval = action_stats[i].sum_sq_eval.load() - init_stats[i].sum_sq_eval;
+	}
+	AddActionStats(stats);
+	munmap(region, region_size);
+
+	return 0; // the stopping rule is not used in the tree-parallel mode
+}
+
+void KnowledgeState::RunSharedTests(int num_tests, atomic<int>* root_visits, SharedArmStats* option_stats, SharedArmStats* action_stats)
+{
+	for (int i = 0; i < num_tests && !IsOutOfTime(); i++)
+	{
+		// select down the tree, leaving a virtual loss on the way so that the other workers are steered to other arms
+		int parent_visits = root_visits->fetch_add(1);
+		int option_index = SelectSharedArm(option_stats, option_nodes.size(), parent_visits);
+		SharedArmStats& option_arm = option_stats[option_index];
+		parent_visits = option_arm.num_visits.fetch_add(1);
+		AddSharedEval(option_arm.sum_eval, VIRTUAL_LOSS_EVAL);
+		int action_index = valid_option_starts[option_index] + SelectSharedArm(action_stats + valid_option_starts[option_index], valid_option_starts[option_index + 1] - valid_option_starts[option_index], parent_visits);
+		SharedArmStats& action_arm = action_stats[action_index];
+		action_arm.num_visits.fetch_add(1);
+		AddSharedEval(action_arm.sum_eval, VIRTUAL_LOSS_EVAL);
+
+		double tmp_eval = RunSingleTest([&](Player* player)
+		{
+			player->PerformCompactAction(valid_actions[action_index]);
+			if (player->is_turn_active)
+				player->TakeRolloutInputs();
+			return player->GetLookaheadEval();
+		});
+
+		// replace the virtual losses with the actual evaluation (the visits are already counted)
+		AddSharedEval(action_arm.sum_eval, tmp_eval - VIRTUAL_LOSS_EVAL);
+		AddSharedEval(action_arm.sum_sq_eval, tmp_eval * tmp_eval);
+		AddSharedEval(option_arm.sum_eval, tmp_eval - VIRTUAL_LOSS_EVAL);
+	}
+}
+
+bool KnowledgeState::PerformTreeAction(TurnSearchNode*& search_root)
+{
+	// search/test, the visits kept from the previous decision of the turn count towards the budget (but every action should still be tried at least once)
+	int total_num_tests = 0;
+	if (num_actions > 1)
+		total_num_tests = max((num_actions - 1) * num_tests_scaling - search_root->num_visits, search_root->CountUnvisited(valid_actions.data(), num_actions));
+	if (time_budget.is_anytime)
+		total_num_tests = (num_actions > 1 ? MAX_ANYTIME_NUM_TESTS : 0);
+	RunTreeTests(search_root, total_num_tests, true);
+
+	// move the root down to the optimal action and execute it
+	CompactAction action = search_root->GetOptimalAction(valid_actions.data(), num_actions);
+	TurnSearchNode* next_root = search_root->DetachChild(action);
+	delete search_root;
+	search_root = next_root;
+	return ExecuteAction(action);
+}
+
+void KnowledgeState::SearchTurnPlan(vector<CompactAction>& plan)
+{
+	plan.clear();
+	if (num_actions == 1 && valid_actions[0].type == ACTION_TYPE_END_TURN) // nothing to plan
+	{
+		plan.push_back(valid_actions[0]);
+		return;
+	}
+
+	// unlike a single decision, a lone valid action still needs the search for the actions after it
+	int total_num_tests = num_actions * num_tests_scaling * TURN_PLAN_BUDGET_FACTOR;
+	if (time_budget.is_anytime)
+		total_num_tests = MAX_ANYTIME_NUM_TESTS;
+	TurnSearchNode* root = new TurnSearchNode();
+	RunTreeTests(root, total_num_tests, false);
+	root->GetBestPlan(plan);
+	if (plan.empty()) // e.g. out of time before the first test
+		plan.push_back(valid_actions[0]);
+	delete root;
+}
+
+void KnowledgeState::RunTreeTests(TurnSearchNode* root, int total_num_tests, bool is_early_stop_allowed)
+{
+	vector<CompactAction> action_buffer(MAX_NUM_COMPACT_ACTIONS);
+	int init_visits = root->num_visits;
+	int num_tests_saved = RunParallelTests(total_num_tests, num_search_workers,
+		[&](int num_tests)
+		{
+			vector<ActionStats> stats;
+			for (int i = 0; i < num_tests && !IsOutOfTime(); i++)
+			{
+				if (i > 0 && is_early_stop_allowed && IsEarlyStopCheck(i))
+				{
+					root->GetActionStats(valid_actions.data(), num_actions, stats);
+					if (IsDecisionClear(stats, early_stopping_delta))
+						return num_tests - i;
+				}
+				copy(valid_actions.begin(), valid_actions.end(), action_buffer.begin());
+				RunSingleTest([&](Player* player) { return root->TestAction(player, action_buffer.data(), MAX_NUM_COMPACT_ACTIONS, num_actions); });
+			}
+			return 0;
+		},
+		[&](vector<ActionStats>& stats) { root->GetActionStats(valid_actions.data(), num_actions, stats); },
+		[&](const vector<ActionStats>& stats) { root->AddActionStats(valid_actions.data(), num_actions, stats); }); // the subtrees grown by the other workers are not merged, only the root statistics
+	RecordSearchStats(total_num_tests, root->num_visits - init_visits, num_tests_saved);
+}
+
+TurnSearchNode::TurnSearchNode() : num_visits(0), edges()
+{
+}
+
+TurnSearchNode::~TurnSearchNode()
+{
+	for (auto it = edges.begin(); it != edges.end(); it++)
+		delete it->child;
+}
+
+CompactAction TurnSearchNode::GetOptimalAction(const CompactAction* actions, int num_actions) const
+{
+	double best_eval = -1e10;
+	CompactAction best_action = actions[0];
+
+	for (int i = 0, k = 0; i < num_actions; i++)
+	{
+		k = FindEdge(actions[i], k);
+		if (k < 0)
+		{
+			k = 0;
+			continue;
+		}
+		const TurnSearchEdge& edge = edges[k];
+		if (edge.num_visits > 0 && edge.ave_eval > best_eval)
+		{
+			best_eval = edge.ave_eval;
+			best_action = edge.action;
+		}
+		k++;
+	}
+
+	return best_action;
+}
+
+int TurnSearchNode::CountUnvisited(const CompactAction* actions, int num_actions) const
+{
+	int num_unvisited = 0;
+	for (int i = 0, k = 0; i < num_actions; i++)
+	{
+		k = FindEdge(actions[i], k);
+		if (k < 0 || edges[k].num_visits == 0)
+			num_unvisited++;
+		k = (k < 0 ? 0 : k + 1);
+	}
+
+	return num_unvisited;
+}
+
+double TurnSearchNode::TestAction(Player* player, CompactAction* action_buffer, int capacity, int num_actions)
+{
+	// make sure each valid action has an edge, choose the first unvisited one if any, otherwise UCB-1 among the valid ones
+	int selected_index = -1;
+	double max_priority_weight = -1e10;
+	double two_ln_visits = 2.0 * log(num_visits);
+	for (int i = 0, k = 0; i < num_actions; i++)
+	{
+		k = FindEdge(action_buffer[i], k);
+		if (k < 0)
+			k = AddEdge(action_buffer[i]);
+
+		int tmp_visits = edges[k].num_visits;
+		if (tmp_visits == 0)
+		{
+			selected_index = k;
+			break;
+		}
+
+		double tmp_weight = edges[k].ave_eval + 2.0 * sqrt(two_ln_visits / (double)tmp_visits); // UCB-1, the 2.0 is for scalling up for range -1 ~ 1 as opposed to 0 ~ 1
+		if (tmp_weight > max_priority_weight)
+		{
+			max_priority_weight = tmp_weight;
+			selected_index = k;
+		}
+		k++;
+	}
+
+	num_visits++;
+	player->PerformCompactAction(edges[selected_index].action);
+	double tmp_eval;
+	if (!player->is_turn_active)
+		tmp_eval = player->GetLookaheadEval();
+	else if (edges[selected_index].num_visits == 0) // newly reached, finish the turn with a rollout
+	{
+		player->TakeRolloutInputs();
+		tmp_eval = player->GetLookaheadEval();
+	}
+	else
+	{
+		if (!edges[selected_index].child)
+			edges[selected_index].child = new TurnSearchNode();
+		int option_starts[MAX_NUM_OPTIONS + 1];
+		int num_options;
+		int num_next_actions = player->EnumerateActions(action_buffer, capacity, option_starts, num_options);
+		tmp_eval = edges[selected_index].child->TestAction(player, action_buffer, capacity, num_next_actions);
 	}
 
-	return action_set.size();
+	TurnSearchEdge& edge = edges[selected_index];
+	edge.num_visits++;
+	edge.sum_eval += tmp_eval;
+	edge.sum_sq_eval += tmp_eval * tmp_eval;
+	edge.ave_eval = edge.sum_eval / (double)edge.num_visits;
+	return tmp_eval;
 }
 
-void PlayActionSet::PerformRandomAction(Player* player) const
+void TurnSearchNode::GetActionStats(const CompactAction* actions, int num_actions, vector<ActionStats>& stats) const
 {
-	int i = GetRandInt(action_set.size());
-	action_set[i]->PerformAction(player);
+	stats.resize(num_actions);
+	for (int i = 0, k = 0; i < num_actions; i++)
+	{
+		stats[i].num_visits = 0;
+		stats[i].sum_eval = 0.0;
+		stats[i].sum_sq_eval = 0.0;
+		k = FindEdge(actions[i], k);
+		if (k < 0)
+		{
+			k = 0;
+			continue;
+		}
+		stats[i].num_visits = edges[k].num_visits;
+		stats[i].sum_eval = edges[k].sum_eval;
+		stats[i].sum_sq_eval = edges[k].sum_sq_eval;
+		k++;
+	}
 }
 
-AttackActionSet::AttackActionSet(int _card_index) : card_index(_card_index)
+void TurnSearchNode::AddActionStats(const CompactAction* actions, int num_actions, const vector<ActionStats>& stats)
 {
+	for (int i = 0, k = 0; i < num_actions; i++)
+	{
+		if (stats[i].num_visits == 0)
+			continue;
+		k = FindEdge(actions[i], k);
+		if (k < 0)
+			k = AddEdge(actions[i]);
+		TurnSearchEdge& edge = edges[k];
+		edge.num_visits += stats[i].num_visits;
+		edge.sum_eval += stats[i].sum_eval;
+		edge.sum_sq_eval += stats[i].sum_sq_eval;
+		edge.ave_eval = edge.sum_eval / (double)edge.num_visits;
+		num_visits += stats[i].num_visits;
+		k++;
+	}
 }
 
-int AttackActionSet::CreateValidSet(Player* player)
+void TurnSearchNode::GetBestPlan(vector<CompactAction>& plan) const
 {
-	if (card_index < 0 || card_index > player->field.size())
-		return 0;
-
-	for (int i = player->field.size() + 1; i <= player->field.size() + player->opponent->field.size() + 1; i++)
+	const TurnSearchNode* node = this;
+	int min_visits = 1; // the first action only needs to be tried, the later ones need enough visits to be trusted
+	while (node)
 	{
-		AttackAction* tmp_action = new AttackAction(card_index, i);
-		if (tmp_action->CheckValid(player))
-			action_set.push_back(tmp_action);
-		else
-			delete tmp_action;
-	}
+		int best_index = -1;
+		double best_eval = -1e10;
+		for (int k = 0; k < node->edges.size(); k++)
+		{
+			const TurnSearchEdge& edge = node->edges[k];
+			if (edge.num_visits >= min_visits && edge.ave_eval > best_eval)
+			{
+				best_eval = edge.ave_eval;
+				best_index = k;
+			}
+		}
+		if (best_index < 0)
+			break;
 
-	return action_set.size();
+		plan.push_back(node->edges[best_index].action);
+		node = node->edges[best_index].child;
+		min_visits = TURN_PLAN_MIN_VISITS;
+	}
 }
 
-int AttackActionSet::RecheckValidity(Player* player)
+TurnSearchNode* TurnSearchNode::DetachChild(const CompactAction& action)
 {
-	// well there are more efficient algorithms to delete multiple entries but we expect this to rarely happen
-	for (int i = action_set.size() - 1; i >= 0; i--) // note erasing when looping with iterators is more error prone 
-	{
-		if (!action_set[i]->CheckValid(player))
-			action_set.erase(action_set.begin() + i);
-	}
+	int k = FindEdge(action, 0);
+	TurnSearchNode* child = (k >= 0 ? edges[k].child : nullptr);
+	if (k >= 0)
+		edges[k].child = nullptr;
 
-	return action_set.size();
+	return (child ? child : new TurnSearchNode());
 }
 
-void AttackActionSet::PerformRandomAction(Player* player) const
+int TurnSearchNode::AddEdge(const CompactAction& action)
 {
-	int i = GetRandInt(action_set.size());
-	action_set[i]->PerformAction(player);
+	TurnSearchEdge new_edge;
+	new_edge.action = action;
+	new_edge.num_visits = 0;
+	new_edge.sum_eval = 0.0;
+	new_edge.sum_sq_eval = 0.0;
+	new_edge.ave_eval = 0.0;
+	new_edge.child = nullptr;
+	edges.push_back(new_edge);
+
+	return edges.size() - 1;
 }
 
-EndTurnActionSet::EndTurnActionSet()
+int TurnSearchNode::FindEdge(const CompactAction& action, int hint) const
 {
+	// the actions are usually enumerated in the same order as the edges were created, so the hint (the edge after the previous match) is mostly a hit
+	if (hint < edges.size() && IsSameCompactAction(edges[hint].action, action))
+		return hint;
+	for (int k = 0; k < edges.size(); k++)
+		if (IsSameCompactAction(edges[k].action, action))
+			return k;
+
+	return -1;
 }
 
-int EndTurnActionSet::CreateValidSet(Player* player)
+
+/* Replay Section */
+
+
+template <typename T>
+void WriteBinaryVal(ofstream& fs, T val)
 {
-	action_set.push_back(new EndTurnAction());
-	return 1;
+	fs.write((const char*)&val, sizeof(T));
 }
 
-int EndTurnActionSet::RecheckValidity(Player* player)
+template <typename T>
+bool ReadBinaryVal(ifstream& fs, T& val)
 {
-	return 1;
+	fs.read((char*)&val, sizeof(T));
+	return (bool)fs;
 }
 
-void EndTurnActionSet::PerformRandomAction(Player* player) const
+MatchReplay::MatchReplay() : match_seed(0), init_hp(0), first_deck_seeds(), second_deck_seeds(), steps()
 {
-	action_set[0]->PerformAction(player);
 }
 
+void MatchReplay::Begin(const vector<int>& _first_deck_seeds, const vector<int>& _second_deck_seeds, int _init_hp)
+{
+	match_seed = GetRandInt();
+	RandInit(match_seed);
+	init_hp = _init_hp;
+	first_deck_seeds = _first_deck_seeds;
+	second_deck_seeds = _second_deck_seeds;
+	steps.clear();
+}
 
-KnowledgeActionNode::KnowledgeActionNode(const ActionEntity * _action) : num_visits(0), sum_eval(0.0), ave_eval(0.0), action(_action)
+void MatchReplay::RecordAction(int player_index, int type, int src, int pos, int des)
 {
+	ReplayStep step;
+	step.player = player_index;
+	step.type = type;
+	step.src = src;
+	step.pos = pos;
+	step.des = des;
+	step.seed = GetRandInt();
+	RandInit(step.seed);
+	steps.push_back(step);
 }
 
-const ActionEntity* KnowledgeActionNode::GetAction() const
+void MatchReplay::Write(ofstream& fs) const
 {
-	return action;
+	WriteBinaryVal<unsigned>(fs, REPLAY_MAGIC);
+	WriteBinaryVal<int>(fs, REPLAY_VERSION);
+	WriteBinaryVal<int>(fs, match_seed);
+	WriteBinaryVal<int>(fs, init_hp);
+	WriteBinaryVal<int>(fs, first_deck_seeds.size());
+	for (int i = 0; i < first_deck_seeds.size(); i++)
+		WriteBinaryVal<int>(fs, first_deck_seeds[i]);
+	WriteBinaryVal<int>(fs, second_deck_seeds.size());
+	for (int i = 0; i < second_deck_seeds.size(); i++)
+		WriteBinaryVal<int>(fs, second_deck_seeds[i]);
+	WriteBinaryVal<int>(fs, steps.size());
+	for (int i = 0; i < steps.size(); i++)
+	{
+		WriteBinaryVal<signed char>(fs, steps[i].player);
+		WriteBinaryVal<signed char>(fs, steps[i].type);
+		WriteBinaryVal<short>(fs, steps[i].src);
+		WriteBinaryVal<short>(fs, steps[i].pos);
+		WriteBinaryVal<short>(fs, steps[i].des);
+		WriteBinaryVal<int>(fs, steps[i].seed);
+	}
 }
 
-double KnowledgeActionNode::TestAction(Player* player)
+bool MatchReplay::Read(ifstream& fs)
 {
-	action->PerformAction(player);
-	if (player->is_turn_active)
-		player->TakeRandomAIInputs();
-	num_visits++;
-	double tmp_eval = player->GetHeuristicEval();
-	sum_eval += tmp_eval;
-	ave_eval = sum_eval / (double)num_visits;
-	return tmp_eval;
+	unsigned magic;
+	int version, n;
+	if (!ReadBinaryVal(fs, magic) || magic != REPLAY_MAGIC)
+		return false;
+	if (!ReadBinaryVal(fs, version) || version != REPLAY_VERSION)
+		return false;
+	if (!ReadBinaryVal(fs, match_seed) || !ReadBinaryVal(fs, init_hp))
+		return false;
+
+	if (!ReadBinaryVal(fs, n) || n < 0)
+		return false;
+	first_deck_seeds.resize(n);
+	for (int i = 0; i < n; i++)
+		if (!ReadBinaryVal(fs, first_deck_seeds[i]))
+			return false;
+	if (!ReadBinaryVal(fs, n) || n < 0)
+		return false;
+	second_deck_seeds.resize(n);
+	for (int i = 0; i < n; i++)
+		if (!ReadBinaryVal(fs, second_deck_seeds[i]))
+			return false;
+
+	if (!ReadBinaryVal(fs, n) || n < 0)
+		return false;
+	steps.resize(n);
+	for (int i = 0; i < n; i++)
+		if (!ReadBinaryVal(fs, steps[i].player) || !ReadBinaryVal(fs, steps[i].type) || !ReadBinaryVal(fs, steps[i].src)
+			|| !ReadBinaryVal(fs, steps[i].pos) || !ReadBinaryVal(fs, steps[i].des) || !ReadBinaryVal(fs, steps[i].seed))
+			return false;
+
+	return true;
 }
 
-KnowledgeOptionNode::KnowledgeOptionNode(const ActionSetEntity* _action_set) : num_visits(0), sum_eval(0.0), ave_eval(0.0), action_nodes()
+MatchReplayer::MatchReplayer(const MatchReplay& _replay) : replay(_replay), first_player(nullptr), second_player(nullptr), curr_step(0), event_queue()
 {
-	for (auto it = _action_set->action_set.begin(); it != _action_set->action_set.end(); it++)
-		action_nodes.push_back(new KnowledgeActionNode(*it));
+	Restart();
 }
 
-KnowledgeOptionNode::~KnowledgeOptionNode()
+MatchReplayer::~MatchReplayer()
 {
-	for (auto it = action_nodes.begin(); it != action_nodes.end(); it++)
-		delete (*it);
+	ClearMatch();
 }
 
-const KnowledgeActionNode* KnowledgeOptionNode::GetOptimalActionNode() const
+void MatchReplayer::Restart()
 {
-	double best_eval = -1e10;
-	const KnowledgeActionNode* best_node = nullptr;
+	ClearMatch();
 
-	for (auto it = action_nodes.begin(); it != action_nodes.end(); it++)
-	{
-		const KnowledgeActionNode* tmp_node = (*it);
-		double tmp_eval = tmp_node->ave_eval;
-		if (tmp_eval > best_eval)
-		{
-			best_eval = tmp_eval;
-			best_node = tmp_node;
-		}
-	}
+	// the same sequence of calls as when the match was recorded, from the point the match seed was applied
+	RandInit(replay.match_seed);
+	vector<Card*> first_deck = GenerateRandDeckFromSeedList(replay.first_deck_seeds);
+	vector<Card*> second_deck = GenerateRandDeckFromSeedList(replay.second_deck_seeds);
 
-	return best_node;
-}
+	first_player = new Player("First_Player", replay.init_hp, first_deck, true, event_queue);
+	second_player = new Player("Second_Player", replay.init_hp, second_deck, true, event_queue);
 
-double KnowledgeOptionNode::TestAction(Player* player)
-{
-	KnowledgeActionNode* selected_node = nullptr;
+	first_player->opponent = second_player;
+	second_player->opponent = first_player;
 
-	// first see if there is any unvisited child
-	auto it = action_nodes.begin();
-	while (it != action_nodes.end() && (*it)->num_visits > 0)
-		it++;
-	// if not then it should be at the "end()" at this point, we do UCB-1 for a mult-armed bandit choice; if so then the "it" should be pointing to the first unvisited child at this point, we choose that node
-	if (it == action_nodes.end())
-	{
-		double max_priority_weight = -1e10;
-		double two_ln_visits = 2.0 * log(num_visits);
-		for (it = action_nodes.begin(); it != action_nodes.end(); it++)
-		{
-			KnowledgeActionNode* tmp_node = (*it);
-			int tmp_visits = tmp_node->num_visits;
-			if (tmp_visits == 0)
-			{
-				selected_node = tmp_node;
-				break;
-			}
+	first_player->SetAllCardAfflications();
+	second_player->SetAllCardAfflications();
 
-			double tmp_eval = tmp_node->ave_eval;
-			double tmp_weight = tmp_eval + 2.0 * sqrt(two_ln_visits / (double)tmp_visits); // UCB-1, the 2.0 is for scalling up for range -1 ~ 1 as opposed to 0 ~ 1
-			if (tmp_weight > max_priority_weight)
-			{
-				max_priority_weight = tmp_weight;
-				selected_node = tmp_node;
-			}
-		}
-	}
-	else
-		selected_node = (*it);
+	first_player->InitialCardDraw(false);
+	second_player->InitialCardDraw(true);
 
-	num_visits++;
-	double tmp_eval = selected_node->TestAction(player);
-	sum_eval += tmp_eval;
-	ave_eval = sum_eval / (double)num_visits;
-	return tmp_eval;
+	first_player->StartTurn();
+	curr_step = 0;
 }
 
-KnowledgeState::KnowledgeState(Player* _player, queue<DeferredEvent*>& event_queue, PtrRedirMap& redir_map) : num_visits(0), option_nodes(), num_tests_scaling(_player->ai_level), orig_player(_player), ally_player(_player->CreateKnowledgeCopy(COPY_ALLY, event_queue, redir_map)), oppo_player(_player->opponent->CreateKnowledgeCopy(COPY_OPPO, event_queue, redir_map))
+bool MatchReplayer::StepForward()
 {
-	ally_player->opponent = oppo_player;
-	oppo_player->opponent = ally_player;
-	ally_player->SetAllCardAfflications();
-	oppo_player->SetAllCardAfflications();
-
-	vector<ActionSetEntity*> option_set = _player->GetOptionSet();
+	if (curr_step >= replay.steps.size() || IsEnded())
+		return false;
 
-	// re-check if each action is still in the knowledge copy, if not remove (this is a relatively native solution, it guarentees not broken by only considering actions that are valid in both truth state and knowledge state)
-	num_actions = 0;
-	// well there are more efficient algorithms to delete multiple entries but we expect this to rarely happen
-	for (int i = option_set.size() - 1; i >= 0; i--) // note erasing when looping with iterators is more error prone
-	{
-		int tmp_num_actions = option_set[i]->RecheckValidity(ally_player);
-		if (tmp_num_actions > 0)
-			num_actions += tmp_num_actions;
-		else
-			option_set.erase(option_set.begin() + i);
-	}
+	const ReplayStep& step = replay.steps[curr_step];
+	Player* player = (step.player == 0 ? first_player : second_player);
 
-	for (auto it = option_set.begin(); it != option_set.end(); it++)
-		option_nodes.push_back(new KnowledgeOptionNode(*it));
-}
+	RandInit(step.seed);
+	CompactAction action;
+	action.type = step.type;
+	action.src = step.src;
+	action.pos = step.pos;
+	action.des = step.des;
+	player->PerformCompactAction(action);
+	curr_step++;
 
-KnowledgeState::~KnowledgeState()
-{
-	for (auto it = option_nodes.begin(); it != option_nodes.end(); it++)
-		delete (*it);
+	// the turn loop in the simulation starts the opponent's turn right after the turn ends, before the AI of the opponent consumes any random numbers
+	if (!player->is_turn_active && !IsEnded())
+		player->opponent->StartTurn();
 
-	// note: don't delete the orig_player as it is managed in the actual game
-	delete ally_player;
-	delete oppo_player;
+	return true;
 }
 
-const ActionEntity* KnowledgeState::GetOptimalAction() const
+void MatchReplayer::SeekTo(int step)
 {
-	double best_eval = -1e10;
-	const ActionEntity* best_action = nullptr;
-	
-	for (auto it = option_nodes.begin(); it != option_nodes.end(); it++)
-	{
-		const KnowledgeActionNode* tmp_best_node = (*it)->GetOptimalActionNode();
-		double tmp_best_eval = tmp_best_node->ave_eval;
-		if (tmp_best_eval > best_eval)
-		{
-			best_eval = tmp_best_eval;
-			best_action = tmp_best_node->GetAction();
-		}
-	}
-
-	return best_action;
+	if (step < curr_step)
+		Restart();
+	while (curr_step < step && StepForward());
 }
 
-double KnowledgeState::TestAction(Player* player)
+bool MatchReplayer::IsEnded() const
 {
-	KnowledgeOptionNode* selected_node = nullptr;
-
-	// first see if there is any unvisited child
-	auto it = option_nodes.begin();
-	while (it != option_nodes.end() && (*it)->num_visits > 0)
-		it++;
-	// if not then it should be at the "end()" at this point, we do UCB-1 for a mult-armed bandit choice; if so then the "it" should be pointing to the first unvisited child at this point, we choose that node
-	if (it == option_nodes.end())
-	{
-		double max_priority_weight = -1e10;
-		double two_ln_visits = 2.0 * log(num_visits);
-		for (it = option_nodes.begin(); it != option_nodes.end(); it++)
-		{
-			KnowledgeOptionNode* tmp_node = (*it);
-			int tmp_visits = tmp_node->num_visits;
-			if (tmp_visits == 0)
-			{
-				selected_node = tmp_node;
-				break;
-			}
-
-			double tmp_eval = tmp_node->ave_eval;
-			double tmp_weight = tmp_eval + 2.0 * sqrt(two_ln_visits / (double)tmp_visits); // UCB-1, the 2.0 is for scalling up for range -1 ~ 1 as opposed to 0 ~ 1
-			if (tmp_weight > max_priority_weight)
-			{
-				max_priority_weight = tmp_weight;
-				selected_node = tmp_node;
-			}
-		}
-	}
-	else
-		selected_node = (*it);
-
-	num_visits++;
-	double tmp_eval = selected_node->TestAction(player);
-	return tmp_eval;
+	return first_player->CheckLose() || second_player->CheckLose();
 }
 
-void KnowledgeState::PerformAction()
+void MatchReplayer::ClearMatch()
 {
-	// search/test
-	int total_num_tests = (num_actions - 1) * num_tests_scaling; // subtract one because if there were only one action there is no need to test
-	for (int i = 0; i < total_num_tests; i++)
+	while (!event_queue.empty())
 	{
-		queue<DeferredEvent*> event_queue;
-		PtrRedirMap redir_map;
-		Player* ally_copy = ally_player->CreateKnowledgeCopy(COPY_EXACT, event_queue, redir_map);
-		Player* oppo_copy = oppo_player->CreateKnowledgeCopy(COPY_EXACT, event_queue, redir_map);
-		ally_copy->opponent = oppo_copy;
-		oppo_copy->opponent = ally_copy;
-		ally_copy->SetAllCardAfflications();
-		oppo_copy->SetAllCardAfflications();
-		TestAction(ally_copy);
-		while (!event_queue.empty())
-		{
-			delete event_queue.front(); // note: this is not deleting the actual card but the entity for flagging
-			event_queue.pop();
-		}
-		delete ally_copy;
-		delete oppo_copy;
+		delete event_queue.front(); // note: this is not deleting the actual card but the entity for flagging
+		event_queue.pop();
 	}
-
-	// execute the optimal action
-	GetOptimalAction()->PerformAction(orig_player);
+	if (first_player)
+		delete first_player;
+	if (second_player)
+		delete second_player;
+	first_player = nullptr;
+	second_player = nullptr;
 }
 
 
@@ -2243,16 +4099,92 @@ double NormalizeCode(double val, double min_val, double max_val)
 	return (2* val - max_val - min_val) / (max_val - min_val);
 }
 
+void GenerateCardRep(int seed, CardRep& card_rep)
+{
+	Card* tmp_card = GenerateSingleCard(seed);
+	card_rep.clear();
+	tmp_card->FillRep(card_rep);
+	DeleteCard(tmp_card);
+}
+
 void GetCardRepsFromSeeds(const vector<int>& seed_list, vector<CardRep>& card_reps)
 {
 	int p = seed_list.size();
 
 	card_reps.resize(p);
 	for (int i = 0; i < p; i++)
+		GenerateCardRep(seed_list[i], card_reps[i]);
+}
+
+void GetCardRepsFromSeedsParallel(const vector<int>& seed_list, vector<CardRep>& card_reps, int num_workers)
+{
+	int p = seed_list.size();
+
+	if (num_workers <= 0)
+		num_workers = thread::hardware_concurrency();
+	if (num_workers > p)
+		num_workers = p;
+	if (num_workers > 1 && is_torch_initialized)
+	{
+		#ifndef SUPPRESS_ALL_MSG
+		cout << "Torch is initialized, generating the card reps serially." << endl;
+		#endif
+		num_workers = 1;
+	}
+	if (num_workers <= 1)
 	{
-		Card* tmp_card = GenerateSingleCard(seed_list[i]);
-		tmp_card->FillRep(card_reps[i]);
+		GetCardRepsFromSeeds(seed_list, card_reps);
+		return;
 	}
+
+	card_reps.resize(p);
+	RunForkedWorkers(0, num_workers,
+		[&](int w, FILE* fp) // generate the slice and write the reps
+		{
+			CardRep card_rep;
+			for (int i = (long long)p * w / num_workers; i < (long long)p * (w + 1) / num_workers; i++)
+			{
+				GenerateCardRep(seed_list[i], card_rep);
+
+				int num_nodes = card_rep.size();
+				fwrite(&num_nodes, sizeof(int), 1, fp);
+				for (const NodeRep& node : card_rep)
+				{
+					int num_terms = node.term_info.size();
+					fwrite(&node.choice, sizeof(int), 1, fp);
+					fwrite(&num_terms, sizeof(int), 1, fp);
+					fwrite(node.term_info.data(), sizeof(double), num_terms, fp);
+				}
+			}
+			return true;
+		},
+		[]() {},
+		[&](int w, FILE* fp)
+		{
+			for (int i = (long long)p * w / num_workers; i < (long long)p * (w + 1) / num_workers; i++)
+			{
+				int num_nodes;
+				if (fread(&num_nodes, sizeof(int), 1, fp) != 1)
+					return false;
+				card_reps[i].clear();
+				for (int j = 0; j < num_nodes; j++)
+				{
+					int choice, num_terms;
+					if (fread(&choice, sizeof(int), 1, fp) != 1 || fread(&num_terms, sizeof(int), 1, fp) != 1)
+						return false;
+					vector<double> term_info(num_terms);
+					if (fread(term_info.data(), sizeof(double), num_terms, fp) != (size_t)num_terms)
+						return false;
+					card_reps[i].push_back(NodeRep(choice, term_info));
+				}
+			}
+			return true;
+		},
+		[&](int w)
+		{
+			for (int i = (long long)p * w / num_workers; i < (long long)p * (w + 1) / num_workers; i++)
+				GenerateCardRep(seed_list[i], card_reps[i]);
+		});
 }
 
 
@@ -2314,6 +4246,8 @@ const int Eff_Utility_Size = 24; // mutable; part of the rules from BaseTargtedE
 const int Destination_Size = 6 + Alle_Cond_Size;
 const int New_Card_Variant_Size = 6 + 1 + Card_Root_Size;
 
+bool is_torch_initialized = false;
+
 CardNet::CardNet() :
 	hidden_to_out(Hidden_Size_2, 1),
 	hidden_1_to_hidden_2(Hidden_Size_1, Hidden_Size_2),
@@ -2360,6 +4294,8 @@ CardNet::CardNet() :
 	register_module("base_untargeted_eff_layer", base_untargeted_eff_layer);
 	register_module("alle_to_cond_layer", alle_to_cond_layer);
 	register_module("new_eff_layer", new_eff_layer);	
+
+	is_torch_initialized = true;
 }
 
 torch::Tensor CardNet::forward_out(const torch::Tensor& root_code)
@@ -3165,6 +5101,11 @@ double PredictCardStrength(Card* card, CardNet& model)
 	CardRep card_rep;
 	card->FillRep(card_rep);
 
+	return PredictCardStrength(card_rep, model);
+}
+
+double PredictCardStrength(const CardRep& card_rep, CardNet& model)
+{
 	torch::NoGradGuard no_grad;
 	model.eval();
 	torch::Tensor card_output = SingleCardSampleForward(card_rep, model);
@@ -7,6 +7,9 @@
 #include <string>
 #include <map>
 #include <fstream>
+#include <functional>
+#include <atomic>
+#include <chrono>
 #include <torch/torch.h>
 
 #define SUPPRESS_ALL_MSG
@@ -46,6 +49,39 @@ using namespace std;
 class Card;
 class ActionSetEntity;
 class DeferredEvent;
+struct CompactAction;
+class TurnSearchNode;
+class KnowledgeState;
+struct SearchTimeBudget;
+class MatchReplay;
+
+unsigned long long ZobristMix(unsigned long long x); // a 64-bit bit mixer (splitmix64 finalizer), used in place of random key tables for (feature, value) pairs
+unsigned long long ZobristCombine(unsigned long long h, long long val); // fold a feature value into a running hash
+unsigned long long GetCardIdentityKey(Card* card); // hash of the card identity (the key of its name), shared by copies
+int GetNthSetBit(unsigned long long mask, int n); // index of the n-th (zero-indexed) set bit from the lowest, -1 if there are not that many
+unsigned long long GetCardStateHash(Card* card); // hash of a card by identity, position type, stats, attributes and overheat state (the index inside a zone is not included)
+
+// origins of card names
+#define NAME_ORIGIN_NONE 0
+#define NAME_ORIGIN_SEED 1 // generated card, "#<seed>"
+#define NAME_ORIGIN_DEFAULT_LEADER 2
+#define NAME_ORIGIN_SND_PLAYER_TOKEN 3
+
+#define MAX_NAME_CHAIN_LEN 8
+
+struct CardName // compact form of a card name: the origin followed by the chain of seeds of the spawns ("<parent>_Spawn_#<seed>"), copied by value without allocation and rendered to text only when needed
+{
+	string Render() const;
+	int origin; // NAME_ORIGIN_*
+	int chain_len; // number of seeds in the chain (the origin seed included for NAME_ORIGIN_SEED), when longer than MAX_NAME_CHAIN_LEN only the first ones and the last one are kept
+	int seeds[MAX_NAME_CHAIN_LEN];
+	unsigned long long key; // hash over the full chain (never 0), used as the identity of the card
+};
+
+CardName mkFixedName(int origin);
+CardName mkSeedName(int seed);
+CardName mkSpawnName(const CardName& parent, int seed);
+ostream& operator<<(ostream& os, const CardName& name);
 
 typedef map<void*, void*> PtrRedirMap;
 typedef map<void*, void*>::iterator PtrRedirMapIter;
@@ -65,6 +101,8 @@ public:
 	bool CleanUp(); // process deferred events, clear corpse, check game end etc., return whether game should end
 	bool ProcessDeferredEvents(); // return whether game should end; only deal with current event queue
 	void ClearCorpse(); // clean spots/cards/minions that should be removed but temporarily retained
+	void CompactZone(vector<Card*>& zone, int& size_adjust, bool& is_dirty); // single stable pass over one zone for ClearCorpse, only called on dirty zones
+	void MarkZoneDirty(int card_pos); // mark the zone corresponding to a card position as possibly containing spots/cards to be cleared
 	bool CheckGameEnd();
 	void FlagDestroy(Card* card, bool start_of_batch);
 	void FlagCastSpell(Card* card, bool start_of_batch);
@@ -101,12 +139,40 @@ public:
 	void SummonToField(Card* card); // does not trigger battlecry, this function itself does not check for field full (if it were full it will be still added but there should be a discard event in the queue right after)
 	void PutToHand(Card* card); // if full, this function itself does not check for field full (if it were full it will be still added but there should be a discard event in the queue right after)
 	void ShuffleToDeck(Card* card); // the position is randomized
+	bool DamageTargets(unsigned long long mask, int amount, Card* src, bool start_of_batch); // damage the characters in the mask (bit z for target z, leaders and fields only) in index order, same as a TakeDamage on each with the AoE batching, return the start_of_batch flag for the following actions
+	void HealTargets(unsigned long long mask, int amount); // restore hp of the characters in the mask (bit z for target z, leaders and fields only)
+	void AddFieldAggregates(Card* card); // add a minion entering the field to the running aggregates used for heuristic evaluation
+	void RemoveFieldAggregates(Card* card); // remove a minion leaving the field from the running aggregates (no effect if it is not included)
+	void UpdateFieldAggregates(Card* card); // refresh the contribution of a minion on the field after its stats/attributes changed
+	void RecomputeAggregates(); // rebuild the aggregates from scratch, used after the field is populated without going through summoning (e.g. copying)
+	int GetEffectiveAtk() const; // sum of atk * max_n_atks over the leader and the minions on the field
+	int GetTauntHpPool() const; // remaining hp of taunt minions on the field, only counted when the leader itself does not have taunt
+	void AddCardHash(Card* card); // add a card that joins one of the zones (leader, field, hand, deck) into the state hash, removing it from its previous owner's hash if any
+	void RemoveCardHash(Card* card); // subtract a card that leaves the zones out of the state hash (no effect if it is not included)
+	void UpdateCardHash(Card* card); // refresh the contribution of an owned card after its stats/attributes/position changed
+	void RecomputeCardsHash(); // rebuild the card part of the state hash from scratch, used after the zones are populated without going through the usual mutation points (e.g. copying)
+	unsigned long long GetSideHash() const; // hash of this player's side: the cards (maintained incrementally) combined with the status (mp, turn number, fatigue etc.)
+	unsigned long long GetStateHash() const; // 64-bit Zobrist-style hash of the pair of players from the perspective of this player
+	unsigned long long GetObservableSideHash(bool is_hand_visible) const; // like GetSideHash but only with the leader, the field and (if visible) the hand, the hidden zones are only represented by their sizes
+	unsigned long long GetObservableStateHash() const; // like GetStateHash but leaving out what this player cannot see (both decks and the opponent's hand)
+	unsigned long long FoldStatusHash(unsigned long long h) const; // combine the status (mp, turn number, fatigue, zone sizes etc.) into a hash of the cards
 	double GetHeuristicEval() const; // the heuristic about how good the situation is for the player, scaled and clamped within -1 ~ 1 (normally clamped to -0.9 ~ 0.9 unless (almost) lose or win), assumes at end of turn state
+	bool IsPlacementIrrelevant(Card* card) const; // whether every field position gives the same outcome when playing the card (up to relabeling of indices), in which case only the canonical position (the rightmost) needs to be considered
 	vector<ActionSetEntity*> GetOptionSet();
+	int EnumerateActions(CompactAction* buffer, int capacity, int* option_starts, int& num_options); // heap-free version of GetOptionSet, writes the valid actions into the buffer grouped by option (play a card/attack with a character/end turn), option i spans [option_starts[i], option_starts[i + 1]), returns the number of actions written
+	bool CheckCompactActionValid(const CompactAction& action);
+	void PerformCompactAction(const CompactAction& action); // assume already checked valid
 	void TakeSearchAIInputs();
-	void TakeSearchAIInput();
+	void TakeSearchAIInput(KnowledgeState*& knowledge_state, queue<DeferredEvent*>& knowledge_event_queue, TurnSearchNode*& search_root, const SearchTimeBudget& time_budget); // knowledge_state is kept through the turn (built here if nullptr, deleted and reset to nullptr once it no longer matches the truth state), its copies defer their events to knowledge_event_queue; search_root is the persistent tree of the turn, nullptr if the tree is not reused
+	void TakePlannedAIInput(vector<CompactAction>& plan, int& plan_pos, const SearchTimeBudget& time_budget); // take the next action of the plan of the turn, searching a new plan first if it is used up or the next action is no longer valid; the plan is dropped after an action with a random outcome
 	void TakeRandomAIInputs();
 	void TakeRandomAIInput();	
+	void TakeRolloutInputs(); // finish the turn with the rollout policy
+	void TakeRolloutInput();
+	void TakeGreedyAIInput(); // epsilon-greedy on GetGreedyActionScore
+	double GetGreedyActionScore(const CompactAction& action) const; // a cheap rule instead of simulating the action: trade favorably (the target dies, preferably without the attacker), go face otherwise, play the cards with more cost first, end the turn when only bad attacks are left
+	void TakeLookaheadInputs(); // the cheap policy for the turns played after the end of a rollout: random actions, truncated to LOOKAHEAD_MAX_ACTIONS_PER_TURN before the turn is ended
+	double GetLookaheadEval(); // evaluation at the end of a simulated turn of the player, after playing search_lookahead_depth more turns if set (cached by the observable state hash), otherwise just the heuristic
 	void TakeInputs();
 	void TakeSingleInput();
 	void DisplayHelp() const;
@@ -134,9 +200,19 @@ public:
 	int field_size_adjust; // the discrepancy between the actual size and the size of the vector, due to the existence of deferred events
 	int hand_size_adjust; // the discrepancy between the actual size and the size of the vector, due to the existence of deferred events
 	int deck_size_adjust; // the discrepancy between the actual size and the size of the vector, due to the existence of deferred events
+	bool is_field_dirty; // whether the field may contain nullptr spots or dying/resetting minions (so that ClearCorpse can skip clean zones)
+	bool is_hand_dirty; // whether the hand may contain nullptr spots or dying/resetting cards (so that ClearCorpse can skip clean zones)
+	bool is_deck_dirty; // whether the deck may contain nullptr spots or dying/resetting cards (so that ClearCorpse can skip clean zones)
+	int field_atk_sum; // running sum of atk * max_n_atks over the minions on the field, maintained incrementally so that the heuristic is O(1)
+	int field_taunt_hp_sum; // running sum of remaining hp over the taunt minions on the field, maintained incrementally so that the heuristic is O(1)
+	unsigned long long cards_hash; // sum (modulo 2^64) of the hashes of all cards owned by this player (zone and stats included), maintained incrementally at the mutation points; a sum rather than xor so that identical cards do not cancel out
 	queue<DeferredEvent*>& event_queue; // reference to the queue for deferred event (shared between two players)
 	int ai_level; // 0 means random ai, 1 ~ 9 means search based ai (the numberical value indicate a scaling factor for the number of search trials)
+	int root_policy; // how the search ai spreads the rollouts over the actions of a decision, ROOT_POLICY_UCB, ROOT_POLICY_SEQ_HALVING or ROOT_POLICY_SEQ_HALVING_OPTIONS
+	int rollout_policy; // how the rollouts of the search ai play the rest of the turn (and the turns of the lookahead), ROLLOUT_POLICY_RANDOM or ROLLOUT_POLICY_GREEDY; carried by the knowledge copies
 	void (Player::*input_func)();
+	MatchReplay* replay; // if not nullptr, the actions (Play, Attack, EndTurn) of this player are recorded into it; never set on knowledge copies
+	int replay_player_index; // 0 for the first player, 1 for the second, only used when recording
 };
 
 
@@ -251,26 +327,86 @@ public:
 #define EFFECT_TIMING_DISCARD 3u
 #define EFFECT_TIMING_TURN 4u // includes turn start and turn end
 
+// trigger types, used to index the compiled effect programs
+#define TRIGGER_PLAY 0
+#define TRIGGER_DESTROY 1
+#define TRIGGER_DISCARD 2
+#define TRIGGER_TURN_START 3
+#define TRIGGER_TURN_END 4
+#define NUM_TRIGGER_TYPES 5
+
+// kernel types, for base targeted effects that have a dedicated path when applied to a set of characters
+#define EFFECT_KERNEL_NONE 0
+#define EFFECT_KERNEL_DAMAGE 1
+#define EFFECT_KERNEL_HEAL 2
+
+// opcodes of the compiled effect programs; node and aux are the operand nodes of the instruction (as Node*), jump is where a failed check continues
+#define EFFECT_OP_SYNC 0 // process the deferred events, stop the trigger if the game ended
+#define EFFECT_OP_ENTER 1 // an effect responding to the trigger (val) is activated
+#define EFFECT_OP_CHECK_LEADER 2 // continue at jump unless the allegiance condition (node) holds for the leader whose turn starts/ends
+#define EFFECT_OP_GUARD 3 // continue at jump if the condition (aux, if any) fails or the untargeted effect (node) is overheated, otherwise count the activation
+#define EFFECT_OP_AOE_DAMAGE 4 // all targets valid for the target condition (node), val is the amount
+#define EFFECT_OP_AOE_HEAL 5
+#define EFFECT_OP_RAND_DAMAGE 6 // a random target valid for the target condition (node), drawn the same way as randEff
+#define EFFECT_OP_RAND_HEAL 7
+#define EFFECT_OP_LEADER_DAMAGE 8 // the leaders valid for the allegiance condition (node)
+#define EFFECT_OP_LEADER_HEAL 9
+#define EFFECT_OP_SELF_DAMAGE 10
+#define EFFECT_OP_SELF_HEAL 11
+#define EFFECT_OP_UNTARGETED 12 // the untargeted action of the base untargeted effect (node), for the effects without a dedicated opcode
+
+struct EffectInstr
+{
+	int op; // EFFECT_OP_*
+	int val; // the amount for damage/heal, the trigger type for EFFECT_OP_ENTER
+	int jump;
+	void* node;
+	void* aux;
+};
+
+struct EffectProgram // compiled form of the other effects chain of a special effects node; each leaf (OtherEff node) is lowered to a block of instructions, and the blocks are grouped by the trigger they respond to so that a trigger runs one interpreter loop instead of walking the chain
+{
+	EffectProgram();
+	void BeginLeaf(int trigger_type); // start the block of the next leaf, in chain order; trigger_type negative if the leaf responds to nothing
+	int Emit(int op, int val, void* node, void* aux); // append an instruction to the current block, returns its index for PatchJump
+	void PatchJump(int index); // make the check at index continue at the end of the current block
+	void Finalize(); // group the blocks by trigger, must be called before executing
+	vector<EffectInstr> leaf_code; // blocks in chain order, jumps relative to the start of the block, only used during compilation
+	vector<int> leaf_starts;
+	vector<int> leaf_triggers;
+	vector<EffectInstr> code; // grouped by trigger, in chain order within each group, each block followed by an EFFECT_OP_SYNC
+	int offsets[NUM_TRIGGER_TYPES + 1]; // code of trigger t is at [offsets[t], offsets[t + 1])
+	bool lead_syncs[NUM_TRIGGER_TYPES]; // whether the chain starts with an effect not responding to the trigger, in which case the deferred events are processed once before the first block (as the chain would do)
+};
+
 
 void IntersectRange(int& min_result, int& max_result, int min1, int max1, int min2, int max2);
 void IntersectRangeInPlace(int& min_val, int& max_val, int other_min_val, int other_max_val);
 void UnionRangeInPlace(int& min_val, int& max_val, int other_min_val, int other_max_val);
 
-class CondConfig
+class CondConfig // trivially copyable and usable in constant expressions, so the prebuilt configs below are initialized at compile time
 {
 public:
-	CondConfig(unsigned _flag, int _min_mp, int _max_mp, int _min_max_mp, int _max_max_mp,
-		int _min_cost, int _max_cost, int _min_atk, int _max_atk, int _min_hp, int _max_hp, int _min_n_atks, int _max_n_atks); // this is the general version
-	CondConfig(unsigned _flag,
-		int _min_cost, int _max_cost, int _min_atk, int _max_atk, int _min_hp, int _max_hp, int _min_n_atks, int _max_n_atks); // this is the version without card-independent settings
-	CondConfig(unsigned _flag); // only with flag specified, all others are default
-	CondConfig(); // default
-	CondConfig operator &= (const CondConfig& config);
-	CondConfig operator &= (unsigned flag);
-	CondConfig operator |= (const CondConfig& config);
-	CondConfig operator |= (unsigned flag);
-	unsigned operator & (unsigned mask) const;
-	unsigned operator | (unsigned mask) const;
+	constexpr CondConfig(unsigned _flag, int _min_mp, int _max_mp, int _min_max_mp, int _max_max_mp,
+		int _min_cost, int _max_cost, int _min_atk, int _max_atk, int _min_hp, int _max_hp, int _min_n_atks, int _max_n_atks) // this is the general version
+		: flag(_flag), min_mp(_min_mp), max_mp(_max_mp), min_max_mp(_min_max_mp), max_max_mp(_max_max_mp), min_cost(_min_cost), max_cost(_max_cost), min_atk(_min_atk), max_atk(_max_atk), min_hp(_min_hp), max_hp(_max_hp), min_n_atks(_min_n_atks), max_n_atks(_max_n_atks) {}
+	constexpr CondConfig(unsigned _flag,
+		int _min_cost, int _max_cost, int _min_atk, int _max_atk, int _min_hp, int _max_hp, int _min_n_atks, int _max_n_atks) // this is the version without card-independent settings
+		: CondConfig(_flag, 0, 10, 0, 10, _min_cost, _max_cost, _min_atk, _max_atk, _min_hp, _max_hp, _min_n_atks, _max_n_atks) {}
+	constexpr CondConfig(unsigned _flag) // only with flag specified, all others are default
+		: CondConfig(_flag, 0, 10, 0, 10, -9, GetFlagMaxHp(_flag), 0, 5) {}
+	constexpr CondConfig() // default
+		: CondConfig(TARGET_TYPE_ANY, 0, 10, 0, 10, -9, 40, 0, 5) {} // -9 is taking into consideration of on destroy (deathrattle) timing
+	CondConfig& operator &= (const CondConfig& config);
+	CondConfig& operator &= (unsigned flag);
+	CondConfig& operator |= (const CondConfig& config);
+	CondConfig& operator |= (unsigned flag);
+	constexpr unsigned operator & (unsigned mask) const { return flag & mask; }
+	constexpr unsigned operator | (unsigned mask) const { return flag | mask; }
+	static constexpr int GetFlagMaxHp(unsigned _flag) // if it is referring to a character and considers minions or only allowing minions then the upper bound for HP become lower
+	{
+		return ((_flag & TARGET_IS_SPELL) || !(_flag & TARGET_IS_MINION)) ? 40 : ((_flag & TARGET_IS_LEADER) ? 20 : 10);
+	}
 	unsigned flag;
 	int min_mp, max_mp; // only applicable for card-independent condition
 	int min_max_mp, max_max_mp; // only applicable for card-independent condition
@@ -280,6 +416,36 @@ public:
 	int min_n_atks, max_n_atks;
 };
 
+// prebuilt configs, copying these avoids running the constructors during generation
+constexpr CondConfig DEFAULT_COND_CONFIG = CondConfig();
+constexpr CondConfig DEFAULT_INIT_COND_CONFIG = CondConfig(TARGET_ANY_POS_TYPE | TARGET_ANY_CARD_ALLE_MINION_TYPE);
+constexpr CondConfig FIELD_COND_CONFIG = CondConfig(FIELD_COND_FILTER);
+constexpr CondConfig HAND_COND_CONFIG = CondConfig(HAND_COND_FILTER);
+constexpr CondConfig DECK_COND_CONFIG = CondConfig(DECK_COND_FILTER);
+constexpr CondConfig HAND_OR_DECK_COND_CONFIG = CondConfig(HAND_OR_DECK_COND_FILTER);
+constexpr CondConfig NOT_HAND_COND_CONFIG = CondConfig(NOT_HAND_COND_FILTER);
+constexpr CondConfig NOT_DECK_COND_CONFIG = CondConfig(NOT_DECK_COND_FILTER);
+constexpr CondConfig LEADER_COND_CONFIG = CondConfig(LEADER_COND_FILTER);
+constexpr CondConfig MINION_COND_CONFIG = CondConfig(MINION_COND_FILTER);
+constexpr CondConfig CHAR_COND_CONFIG = CondConfig(CHAR_COND_FILTER);
+constexpr CondConfig SPELL_COND_CONFIG = CondConfig(SPELL_COND_FILTER);
+constexpr CondConfig NOT_LEADER_COND_CONFIG = CondConfig(NOT_LEADER_COND_FILTER);
+constexpr CondConfig ALLY_COND_CONFIG = CondConfig(ALLY_COND_FILTER);
+constexpr CondConfig OPPO_COND_CONFIG = CondConfig(OPPO_COND_FILTER);
+constexpr CondConfig BEAST_COND_CONFIG = CondConfig(BEAST_COND_FILTER);
+constexpr CondConfig DRAGON_COND_CONFIG = CondConfig(DRAGON_COND_FILTER);
+constexpr CondConfig DEMON_COND_CONFIG = CondConfig(DEMON_COND_FILTER);
+constexpr CondConfig NOT_BEAST_COND_CONFIG = CondConfig(NOT_BEAST_COND_FILTER);
+constexpr CondConfig NOT_DRAGON_COND_CONFIG = CondConfig(NOT_DRAGON_COND_FILTER);
+constexpr CondConfig NOT_DEMON_COND_CONFIG = CondConfig(NOT_DEMON_COND_FILTER);
+constexpr CondConfig NOT_CHARGE_COND_CONFIG = CondConfig(NOT_CHARGE_COND_FILTER);
+constexpr CondConfig NOT_TAUNT_COND_CONFIG = CondConfig(NOT_TAUNT_COND_FILTER);
+constexpr CondConfig NOT_STEALTH_COND_CONFIG = CondConfig(NOT_STEALTH_COND_FILTER);
+constexpr CondConfig NOT_UNTARGETABLE_COND_CONFIG = CondConfig(NOT_UNTARGETABLE_COND_FILTER);
+constexpr CondConfig NOT_SHIELDED_COND_CONFIG = CondConfig(NOT_SHIELDED_COND_FILTER);
+constexpr CondConfig NOT_POISONOUS_COND_CONFIG = CondConfig(NOT_POISONOUS_COND_FILTER);
+constexpr CondConfig NOT_LIFESTEAL_COND_CONFIG = CondConfig(NOT_LIFESTEAL_COND_FILTER);
+
 CondConfig GetInitConfigFromCard(const Card* card); // this does not consider the attributes and assume no attributes
 CondConfig ExtractEffectIndependentConfig(const CondConfig& config);
 CondConfig GetDefaultInitConfig(); // this version is for the initial state of the card, particularly, attribute fields of the flag are zero bits
@@ -293,6 +459,7 @@ CondConfig GetHpConfig(unsigned flag, int min_hp, int max_hp);
 CondConfig GetAtkTimesConfig(unsigned flag, int min_n_atks, int max_n_atks);
 
 extern bool display_overheat_counts; // whether or not to display overheat counter in detailed discripition.
+extern bool use_effect_programs; // whether triggers run through the compiled effect programs or walk the effect chain directly (the latter is kept for differential testing)
 
 string MinionTypeDescription(int type);
 string AttributeDescriptionInline(bool is_charge, bool is_taunt, bool is_stealth, bool is_untargetable, bool is_shielded, bool is_poisonous, bool is_lifesteal); // comma separated list, starting with a " with " if there's any attribute
@@ -309,6 +476,7 @@ double GetGiglRandFloat(double max_val); // 0.0 ~ max_val; artifact from file in
 vector<int> CreateRandomSelection(int n, int k); // select random k numbers from 0 ~ n-1 as a list (ordered randomly); artifact from file including issues
 vector<int> CreateRandomSelectionSorted(int n, int k); // same as above but return guarantee sorted in increasing order 
 Card* GenerateSingleCard(int seed);
+Card* SampleHiddenCard(); // copy of a random card from a pool of HIDDEN_CARD_POOL_SIZE generated cards, a cheap stand-in for generating a new card for each hidden card of a determinization
 string GetCardBrief(Card* card); // artifact from file including issues
 string GetCardDetail(Card* card); // artifact from file including issues
 vector<Card*> GenerateRandDeck(int n, int seed);
@@ -319,6 +487,54 @@ void DecidePlayOrder(Player* player1, Player* player2, Player*& first_player, Pl
 void DeleteCard(Card* card); // artifact from file including issues
 
 
+// traced event types
+#define TRACE_EVENT_DAMAGE 0
+#define TRACE_EVENT_HEAL 1
+#define TRACE_EVENT_SUMMON 2
+#define TRACE_EVENT_DESTROY 3
+#define TRACE_EVENT_DRAW 4
+#define TRACE_EVENT_FATIGUE 5
+#define TRACE_EVENT_EFFECT_TRIGGER 6
+
+#define TRACE_MAGIC 0x52544343u // "CCTR" as little endian bytes, written at the start of each trace file
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_SIZE 4096 // number of events buffered per thread before writing to the file
+
+struct TraceEvent // fixed size record in the binary trace file
+{
+	unsigned long long card_id; // identity key of the card the event happens to
+	unsigned long long src_id; // identity key of the source card, 0 if none
+	int amount; // damage/heal amount (actually restored for heal), fatigue count, or trigger type (TRIGGER_*) for effect triggers; 0 otherwise
+	short turn_num; // turn number of the player owning the card
+	signed char card_pos; // position type of the card when the event happens
+	unsigned char type; // TRACE_EVENT_*
+};
+
+class TraceBuffer // per-thread buffer of trace events, only touched by its own thread so there is no locking
+{
+public:
+	TraceBuffer();
+	~TraceBuffer(); // flush the remaining events (at thread exit)
+	void Push(const TraceEvent& event);
+	void Flush(); // write the buffered events to the file of this thread, opening it (with the header) on the first write
+
+private:
+	TraceEvent events[TRACE_BUFFER_SIZE];
+	int size;
+	ofstream fs;
+};
+
+extern bool is_trace_enabled; // runtime switch, when off the emission sites reduce to a single branch
+void EnableTrace(const string& path_prefix); // each thread writes to its own file <path_prefix>_<thread index>.bin
+void FlushTrace(); // flush the buffer of the calling thread
+void RecordTraceEvent(unsigned type, Card* card, Card* src, int amount); // events on cards of exploring players (AI search) are skipped
+inline void EmitTraceEvent(unsigned type, Card* card, Card* src, int amount)
+{
+	if (is_trace_enabled)
+		RecordTraceEvent(type, card, src, amount);
+}
+
+
 class DeferredEvent // certain parts of effects are not applied immediately but rather pushed into a queue and dealt with afterwards, this is because we don't want inserted events to AoE effects, and also sometimes we want to maintain target indexing unchanged until the effects on one card at a certain point is fully executed
 {
 public:
@@ -401,9 +617,157 @@ public:
 };
 
 
+/* Memory Section */
+
+
+// GIGL generates the card and node classes (so they cannot get their own operator new), the global operator new/delete are replaced instead, but small blocks are only pooled while an AllocPoolScope is alive on the thread (card generation, knowledge copies and rollouts), where the cards, nodes and the strings/containers they own are allocated in large numbers with a few sizes; everything else (libtorch, the rest of the STL) goes to malloc as before
+#define POOL_BLOCK_HEADER_SIZE 16 // keeps the alignment of malloc, stores the size class and the owner thread of the block
+#define POOL_SIZE_CLASS_GRANULARITY 16
+#define POOL_NUM_SIZE_CLASSES 16 // blocks up to 256 bytes are pooled, larger ones go to malloc directly
+#define POOL_MAX_FREE_BLOCKS 4096 // per size class and thread, blocks freed beyond that go back to free
+
+struct AllocCounts // cumulative for the calling thread
+{
+	unsigned long long num_news; // calls to operator new
+	unsigned long long num_sys_allocs; // calls to malloc made by operator new (those not served from the free lists)
+};
+
+extern bool use_alloc_pools; // runtime switch, when off every allocation goes to malloc and freed blocks are returned to free (blocks still carry the header so the switch can be flipped any time)
+AllocCounts GetAllocCounts();
+
+struct AllocPoolScope // small allocations of the thread are served from its free lists while at least one scope is alive; a pooled block only goes back to the free list of the thread that allocated it (freed by another thread, it goes to free), and the free lists are drained into free when the thread exits
+{
+	AllocPoolScope();
+	~AllocPoolScope();
+};
+
+
 /* AI Section */
 
 
+#define ACTION_TYPE_PLAY 0
+#define ACTION_TYPE_ATTACK 1
+#define ACTION_TYPE_END_TURN 2
+
+#define MAX_NUM_TARGETS (2 * MAX_FIELD_SIZE + MAX_HAND_SIZE + 2) // leaders, both fields and the hand (must not exceed 64 for the target masks)
+#define MAX_NUM_OPTIONS (MAX_HAND_SIZE + MAX_FIELD_SIZE + 2) // one per hand card, one per allied character, and end turn
+#define MAX_NUM_COMPACT_ACTIONS (MAX_HAND_SIZE * (MAX_FIELD_SIZE + 1) * MAX_NUM_TARGETS + (MAX_FIELD_SIZE + 1) * (MAX_FIELD_SIZE + 1) + 1) // upper bound on the number of valid actions at a decision point
+
+struct CompactAction // plain data version of the actions, for enumerating without heap allocations
+{
+	int type; // ACTION_TYPE_PLAY, ACTION_TYPE_ATTACK or ACTION_TYPE_END_TURN
+	int src; // card x
+	int pos; // position y (play only)
+	int des; // target z
+};
+
+CompactAction mkPlayAction(int src, int pos, int des);
+CompactAction mkAttackAction(int src, int des);
+CompactAction mkEndTurnAction();
+bool IsSameCompactAction(const CompactAction& action1, const CompactAction& action2);
+
+extern bool use_turn_search_tree; // whether the search keeps one tree through the turn (the subtree of the executed action becomes the next root) instead of starting over for every action
+extern int num_search_workers; // number of processes the rollouts of a decision are split over (root parallelization, each with its own copy of the knowledge state and random stream), 1 means only the calling process, 0 or less means one per core
+
+// ways of splitting a decision over the search workers
+#define PARALLEL_SEARCH_ROOT 0 // each worker keeps its own statistics, merged at the end
+#define PARALLEL_SEARCH_TREE 1 // the workers select through shared statistics of the options and actions, with virtual loss
+
+#define VIRTUAL_LOSS_EVAL -1.0 // a rollout in flight counts as a visit with the lowest evaluation until its result is known
+
+struct SharedArmStats // statistics of an option or an action shared between the search workers, updated without locks
+{
+	atomic<int> num_visits; // including the rollouts in flight
+	atomic<double> sum_eval; // including the virtual losses of the rollouts in flight
+	atomic<double> sum_sq_eval; // only the finished rollouts
+};
+
+static_assert(atomic<int>::is_always_lock_free && atomic<double>::is_always_lock_free, "the shared statistics live in memory mapped between processes, which only works with lock-free atomics");
+
+struct ActionStats // statistics of an action at the root of a decision, as exchanged between the search workers
+{
+	int num_visits;
+	double sum_eval;
+	double sum_sq_eval; // for the variance in the stopping rule
+};
+
+#define EARLY_STOP_CHECK_INTERVAL 16 // number of rollouts between checks of the stopping rule
+#define EARLY_STOP_MIN_VISITS 4 // an action needs at least this many visits before its bounds are trusted
+
+struct SearchStats // counters of the search AI in this process
+{
+	long long num_decisions; // decisions that went through the search
+	long long num_rollouts;
+	long long num_rollouts_saved; // rollouts of the budget not spent because of the stopping rule
+	long long num_lookahead_evals; // rollout ends with the lookahead on (only the ones in this process, not in the search workers)
+	long long num_lookahead_cache_hits;
+};
+
+extern bool use_early_stopping; // whether a decision may stop before its rollout budget once the best action leads all the others with confidence (not applied in the anytime mode, the tree-parallel mode nor the turn plan search)
+extern double early_stopping_delta; // probability of the stopping rule picking a wrong leader (split over the actions)
+
+bool IsDecisionClear(const vector<ActionStats>& stats, double delta); // empirical-Bernstein bounds on the average evaluations (range -1 ~ 1), true if the lower bound of the leader is above the upper bounds of all the others
+SearchStats& GetSearchStats();
+
+#define MAX_ANYTIME_NUM_TESTS 1000000000 // rollout budget in the anytime mode, effectively unbounded as the deadline ends the search
+
+struct SearchTimeBudget // wall-clock limit of a decision of the search AI
+{
+	bool has_deadline;
+	bool is_anytime; // whether to run rollouts until the deadline (otherwise the deadline only cuts the usual rollout budget short)
+	chrono::steady_clock::time_point deadline;
+};
+
+extern double search_time_per_decision; // seconds for each decision of the search AI, when positive the search runs until the deadline and returns the best action so far (anytime mode), otherwise the rollout budget scaled by the AI level is used
+extern bool use_turn_plan; // whether the search ai searches a plan for the rest of the turn (a sequence of actions up to the end of the turn) and follows it, searching again only after an action with a random outcome, instead of searching for every action (only the UCB-1 tree search is used for the plans)
+extern unsigned long long random_outcome_count; // incremented whenever the game takes a random outcome or reveals a hidden card (random targets, draws, shuffles, random spawns), for the planner to tell whether an action may have gone differently than simulated
+
+extern bool use_ismcts; // information-set search: every rollout samples its own determinization of the hidden cards (decks and the opponent's hand) and the statistics of all of them go into the same tree, instead of every rollout of a decision playing in the one determinization of the knowledge state; the hidden cards are then copied from a pool instead of generated
+
+#define HIDDEN_CARD_POOL_SIZE 512
+
+extern int search_lookahead_depth; // number of turns a rollout continues after the end of the searching player's turn (the opponent's reply first, with the cheap policy), 0 means evaluating right at the end of the turn
+
+#define LOOKAHEAD_MAX_ACTIONS_PER_TURN 10 // truncation of the turns in the lookahead
+#define LOOKAHEAD_CACHE_MAX_SAMPLES 8 // a state at the end of the turn stops being played further once it has this many samples, its average is used instead
+
+struct LookaheadCacheEntry
+{
+	int num_samples;
+	double sum_eval;
+};
+
+void ClearLookaheadCache(); // done for every decision
+
+#define TURN_PLAN_BUDGET_FACTOR 3 // a plan search gets this many times the rollout budget of a single decision, as it stands in for the searches of the later actions
+#define TURN_PLAN_MIN_VISITS 4 // an action after the first one only goes into the plan with at least this many visits, otherwise the plan stops there (and the search is done again when reaching that point)
+
+extern double search_time_per_turn; // optional cap in seconds on the search time of a whole turn, 0 or less means no cap; when it runs out the rest of the turn is played by the random policy
+
+// ways of spreading the rollout budget of a decision over its actions
+#define ROOT_POLICY_UCB 0 // UCB-1 over the options and over the actions inside
+#define ROOT_POLICY_SEQ_HALVING 1 // sequential halving over the actions (for picking the best action with a fixed budget)
+#define ROOT_POLICY_SEQ_HALVING_OPTIONS 2 // sequential halving over the options, UCB-1 over the actions inside
+
+// policies of the rollouts
+#define ROLLOUT_POLICY_RANDOM 0 // uniformly random option, then random action inside
+#define ROLLOUT_POLICY_GREEDY 1 // epsilon-greedy on a rule based score of the actions
+
+#define GREEDY_ROLLOUT_EPSILON 0.1 // probability of a random action in the greedy rollout policy
+#define GREEDY_LEADER_VALUE 100.0 // loss in the score of an attack that gets the own leader killed
+
+extern int default_rollout_policy; // rollout policy given to the search ai players when they are created (can be changed per player afterwards)
+
+extern int default_root_policy; // root policy given to the search ai players when they are created (can be changed per player afterwards); the sequential halving policies need a rollout budget so they fall back to UCB-1 in the anytime mode, and they do not use the persistent turn tree, the stopping rule or the tree-parallel mode
+
+extern int parallel_search_mode; // PARALLEL_SEARCH_ROOT or PARALLEL_SEARCH_TREE, only matters with more than one search worker (the persistent turn tree is not used in the tree mode, as its nodes cannot be shared between processes; the plan search and the sequential halving policies stay with root parallelization)
+
+void AddSharedEval(atomic<double>& sum_eval, double val);
+int SelectSharedArm(const SharedArmStats* arms, int num_arms, int parent_visits); // the first arm that nobody has visited (or is visiting), otherwise UCB-1
+
+void RunForkedWorkers(int first_worker, int num_workers, const function<bool(int, FILE*)>& write_share, const function<void()>& run_here, const function<bool(int, FILE*)>& read_share, const function<void(int)>& run_share_here); // forks a worker process for each w in [first_worker, num_workers) which writes its share to its own temporary file with write_share(w, fp); run_here() is the work of the current process meanwhile; the files are then read back in order with read_share(w, fp), and the share of a worker that failed is run here with run_share_here(w)
+int RunParallelTests(int total_num_tests, int num_workers, const function<int(int)>& run_tests, const function<void(vector<ActionStats>&)>& get_stats, const function<void(const vector<ActionStats>&)>& add_stats); // run_tests(k) runs k tests in the current process and returns how many of them the stopping rule skipped; forked workers send back the change of the root statistics (per action, as given by get_stats), which is merged with add_stats; returns the total skipped by the stopping rule; runs everything in the current process once torch is initialized
+
 class ActionEntity
 {
 public:
@@ -492,24 +856,29 @@ public:
 class KnowledgeActionNode
 {
 public:
-	KnowledgeActionNode(const ActionEntity* _action); // it does not need a destructor to delete the action as it will be managed by the ActionSetEntity that owns it anyway
-	const ActionEntity* GetAction() const;
+	KnowledgeActionNode(const CompactAction& _action);
+	const CompactAction* GetAction() const;
 	double TestAction(Player* player); // do a single test of action (try a single trajectory), return the heuristic evaluation at the end of the simulated turn
 	int num_visits;
 	double sum_eval;
+	double sum_sq_eval;
 	double ave_eval;
 
 private:
-	const ActionEntity* action;
+	CompactAction action;
 };
 
 class KnowledgeOptionNode
 {
 public:
-	KnowledgeOptionNode(const ActionSetEntity* _action_set);
+	KnowledgeOptionNode(const CompactAction* actions, int num_actions);
 	~KnowledgeOptionNode();
 	const KnowledgeActionNode* GetOptimalActionNode() const; // optimal action after testing/searching
+	const KnowledgeActionNode* GetActionNode(int index) const;
 	double TestAction(Player* player); // do a single test of action (try a single trajectory), return the heuristic evaluation at the end of the simulated turn
+	double TestActionAt(Player* player, int index); // same as above but testing the given action instead of choosing one
+	void GetActionStats(vector<ActionStats>& stats) const; // appended in the order of the actions
+	int AddActionStats(const vector<ActionStats>& stats, int start); // add the statistics starting from the index, return the index after the last one used
 	int num_visits;
 	double sum_eval;
 	double ave_eval;
@@ -523,20 +892,129 @@ class KnowledgeState
 public:
 	KnowledgeState(Player* _player, queue<DeferredEvent*>& event_queue, PtrRedirMap& redir_map);
 	~KnowledgeState();
-	const ActionEntity* GetOptimalAction() const; // optimal action after testing/searching
+	const CompactAction* GetOptimalAction() const; // optimal action after testing/searching
 	double TestAction(Player* player); // do a single test of action (try a single trajectory), return the heuristic evaluation at the end of the simulated turn
-	void PerformAction(); // test (with a biased tree search) and execute the action of choice (optimal action)
+	void SetTimeBudget(const SearchTimeBudget& _time_budget);
+	bool IsOutOfTime() const;
+	bool IsEarlyStopCheck(int num_tests_done) const; // whether the stopping rule should be checked after this many tests of a worker
+	void RecordSearchStats(int total_num_tests, int num_tests_used, int num_tests_saved) const; // add the decision to the search statistics, num_tests_saved only counts the tests skipped by the stopping rule (not the ones cut by a deadline)
+	bool PerformAction(); // test (with a biased tree search) and execute the action of choice (optimal action), return whether the knowledge state is still usable for the next decision (see ExecuteAction)
+	bool PerformTreeAction(TurnSearchNode*& search_root); // same as above but searching with the persistent tree of the turn, which is replaced by the subtree of the executed action
+	bool ExecuteAction(CompactAction action); // execute the action in the truth state; unless it ended the turn or had a random outcome (so that the determinization may no longer agree with what the player has seen), repeat it on the knowledge copies and enumerate the actions of the next decision, returning true
+	void SearchTurnPlan(vector<CompactAction>& plan); // search a tree of the rest of the turn and follow the best visited actions down from the root for the plan (not executed)
+	void RunTreeTests(TurnSearchNode* root, int total_num_tests, bool is_early_stop_allowed); // run the tests through the tree rooted at the valid actions of this state; the stopping rule only looks at the root, so it is not allowed for the plan search, which needs the deeper nodes too
+	int RunTests(int num_tests); // run the tests on copies of the knowledge state, return the number skipped by the stopping rule
+	double RunSingleTest(const function<double(Player*)>& test_action); // run test_action on a fresh copy of the knowledge state (the ally side is passed), return its evaluation
+	const CompactAction* RunSequentialHalving(int total_num_tests); // split the budget evenly over rounds, each round tests the remaining arms (actions or options depending on the root policy) equally and keeps the better half, return the action of the last arm
+	void RunArmTests(int num_tests, const vector<int>& arms, bool is_option_arms); // tests going round the arms from a random start
+	double GetArmEval(int arm, bool is_option_arms) const; // for an option, the average of its best action
+	const KnowledgeActionNode* GetActionNode(int action_index) const; // by the index in valid_actions
+	void GetActionStats(vector<ActionStats>& stats) const; // per action, in the order of valid_actions
+	void AddActionStats(const vector<ActionStats>& stats);
+	int RunSharedTreeTests(int total_num_tests, int num_workers); // tree parallelization, the workers share the statistics through a shared memory mapping; returns the number of tests skipped by the stopping rule
+	void RunSharedTests(int num_tests, atomic<int>* root_visits, SharedArmStats* option_stats, SharedArmStats* action_stats); // the tests of a single worker in the tree parallelization
 	int num_visits;
 
 private:
+	void EnumerateValidActions(); // (re)build the option nodes from the actions valid in both the truth state and the knowledge state, resetting the statistics
+
 	vector<KnowledgeOptionNode*> option_nodes;
+	vector<CompactAction> valid_actions; // the actions valid in both the truth state and the knowledge state, in the order of the option nodes
+	vector<int> valid_option_starts; // option node i covers [valid_option_starts[i], valid_option_starts[i + 1]) of valid_actions
 	int num_actions; // total number of actions (not necessarily equal to the number of option nodes, as each option node may correspond to multiple actions)
 	int num_tests_scaling; // a scaling factor for number of trials (the number of trials is also related to the number of legal actions)
+	int root_policy;
+	SearchTimeBudget time_budget;
 	Player* orig_player; // the player for taking actual action
 	Player* ally_player;
 	Player* oppo_player;
 };
 
+struct TurnSearchEdge // an action out of a node of the turn search tree, with the statistics of the trajectories through it
+{
+	CompactAction action;
+	int num_visits;
+	double sum_eval;
+	double sum_sq_eval;
+	double ave_eval;
+	TurnSearchNode* child; // nullptr until the action is visited a second time (the first visit is finished by a rollout), or if the action always ends the turn
+};
+
+class TurnSearchNode // node of the persistent search tree of a turn, identified by the sequence of actions from the root (open loop, as the outcomes of actions can be random)
+{
+public:
+	TurnSearchNode();
+	~TurnSearchNode();
+	CompactAction GetOptimalAction(const CompactAction* actions, int num_actions) const; // among the given actions, the one with the best average evaluation (the first one if none is visited)
+	int CountUnvisited(const CompactAction* actions, int num_actions) const; // number of the given actions not visited from this node yet
+	void GetActionStats(const CompactAction* actions, int num_actions, vector<ActionStats>& stats) const; // per given action (zeros if there is no edge)
+	void AddActionStats(const CompactAction* actions, int num_actions, const vector<ActionStats>& stats); // only the edges are updated, the subtrees are not
+	double TestAction(Player* player, CompactAction* action_buffer, int capacity, int num_actions); // one trajectory from this node, the buffer holds the valid actions at this node on entry and is reused for the nodes below; expands at most one node, returns the heuristic evaluation at the end of the simulated turn
+	void GetBestPlan(vector<CompactAction>& plan) const; // append the sequence of the best visited actions from this node down (the ones below the first need TURN_PLAN_MIN_VISITS visits)
+	TurnSearchNode* DetachChild(const CompactAction& action); // take the subtree under the action out of this node (a new empty node if there is none), for it to become the next root
+	int num_visits;
+
+private:
+	int FindEdge(const CompactAction& action, int hint) const; // index of the edge of the action (checking the hint first), -1 if not found
+	int AddEdge(const CompactAction& action); // return the index of the new edge
+
+	vector<TurnSearchEdge> edges;
+};
+
+
+/* Replay Section */
+
+
+#define REPLAY_MAGIC 0x50524343u // "CCRP" as little endian bytes
+#define REPLAY_VERSION 1
+
+struct ReplayStep // one action in the stream of a recorded match
+{
+	signed char player; // 0 for the first player, 1 for the second
+	signed char type; // ACTION_TYPE_PLAY, ACTION_TYPE_ATTACK or ACTION_TYPE_END_TURN
+	short src; // card x
+	short pos; // position y (play only)
+	short des; // target z
+	int seed; // the random generator is restarted with this seed right before the action
+};
+
+class MatchReplay // compact record of a match, enough to reconstruct any of its states without running the AI again
+{
+public:
+	MatchReplay();
+	void Begin(const vector<int>& _first_deck_seeds, const vector<int>& _second_deck_seeds, int _init_hp); // call right before generating the decks, draws the match seed and restarts the random generator with it; note that a recorded match therefore plays out differently from the same match unrecorded
+	void RecordAction(int player_index, int type, int src, int pos, int des); // call right before performing an action, draws a step seed and restarts the random generator with it (so that the random numbers consumed by the AI in between do not matter)
+	void Write(ofstream& fs) const; // append in binary form
+	bool Read(ifstream& fs); // read the next replay in the file, return false if there isn't a valid one
+
+	int match_seed;
+	int init_hp;
+	vector<int> first_deck_seeds; // card seeds in (shuffled) deck order, the first player
+	vector<int> second_deck_seeds; // card seeds in (shuffled) deck order, the second player
+	vector<ReplayStep> steps;
+};
+
+class MatchReplayer // reconstructs the states of a recorded match, step k being right after the k-th action (including the start of next turn if the action ended the turn)
+{
+public:
+	MatchReplayer(const MatchReplay& _replay);
+	~MatchReplayer();
+	void Restart(); // back to step 0, right after the first turn starts
+	bool StepForward(); // perform the next action, return false if there are no more actions
+	void SeekTo(int step); // only restarts if seeking backwards
+	bool IsEnded() const; // whether the match has ended at the current step
+
+	const MatchReplay& replay;
+	Player* first_player;
+	Player* second_player;
+	int curr_step;
+
+private:
+	void ClearMatch();
+
+	queue<DeferredEvent*> event_queue;
+};
+
 
 /* Machine Learning Section */
 
@@ -556,7 +1034,9 @@ NodeRep mkNodeRep(int choice, const vector<double>& term_info);
 NodeRep mkNodeRep(int choice);
 
 double NormalizeCode(double val, double min_val, double max_val); // normalize to -1.0 ~ 1.0
+void GenerateCardRep(int seed, CardRep& card_rep); // the rep of the card generated from the seed, the card is deleted before returning
 void GetCardRepsFromSeeds(const vector<int>& seed_list, vector<CardRep>& card_reps);
+void GetCardRepsFromSeedsParallel(const vector<int>& seed_list, vector<CardRep>& card_reps, int num_workers); // same result as the serial version, the seeds are split into contiguous slices generated by worker processes (as the generator state of GIGL is global, each worker needs its own process); num_workers <= 0 means using all cores; falls back to the serial version once torch is initialized, as forking is not safe after that
 
 
 torch::Tensor CreateZerosTensor(size_t size);
@@ -565,6 +1045,8 @@ torch::Tensor CreateOnehotTensor(int choice, size_t size);
 
 int GetModelSize(const torch::nn::Module* model); // return the number of parameters in the model
 
+extern bool is_torch_initialized; // set when the first CardNet is constructed, from then on the process should not fork (the thread pools of torch do not survive a fork)
+
 struct CardNet : torch::nn::Module
 {
 	CardNet();
@@ -630,4 +1112,5 @@ double ValidateCardNet(const vector<CardRep>& inputs, const vector<double>& labe
 
 void TrainCardStrengthPredictor(const vector<CardRep>& train_reps, const vector<double>& train_strengths, const vector<double>& train_weights, const vector<CardRep>& validate_reps, const vector<double>& validate_strengths, const vector<double>& valdiate_weights, CardNet& model, torch::Device& device, int seed, ofstream& log_fs, const char* train_file, const char* validate_file);
 double PredictCardStrength(Card* card, CardNet& model);
+double PredictCardStrength(const CardRep& card_rep, CardNet& model);
 
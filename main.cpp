@@ -18,6 +18,9 @@ string Card_Model_Path = "card_model.pt";
 string Card_Train_Log_Path = "card_model_train_log.txt";
 string Card_Train_Correlation_Path = "train_correlation.txt";
 string Card_Validate_Correlation_Path = "validate_correlation.txt";
+string Match_Replay_Path = "match_replays.bin";
+
+ofstream Match_Replay_Fs; // when open, the replays of the matches simulated between decks are appended to it (only opened on request, as recording changes the random stream of the matches)
 
 struct MatchStat // can be for a deck or a card
 {
@@ -125,7 +128,7 @@ void ReplaceSignificantCardInDeckPool(vector<vector<int>>& decks, int& selected_
 	ReplaceCardInDecks(decks, selected_index, new_index);
 }
 
-void TestAIs(int ai_level_a, int ai_level_b, const vector<int>& seed_list, const vector<vector<int>>& deck_list, int deck_num, int deck_size) // deck_list stores indices in the seed_list, not the seeds themselves
+void TestAIs(int ai_level_a, int ai_level_b, int root_policy_a, int root_policy_b, int rollout_policy_a, int rollout_policy_b, const vector<int>& seed_list, const vector<vector<int>>& deck_list, int deck_num, int deck_size) // deck_list stores indices in the seed_list, not the seeds themselves
 {
 	MatchStat ai_stat_a, ai_stat_b;
 	for (int i = 0; i < deck_num; i++)
@@ -147,6 +150,10 @@ void TestAIs(int ai_level_a, int ai_level_b, const vector<int>& seed_list, const
 			queue<DeferredEvent*> event_queue;
 			Player player1("AI_A", 30, deck_a, true, event_queue, ai_level_a);
 			Player player2("AI_B", 30, deck_b, true, event_queue, ai_level_b);
+			player1.root_policy = root_policy_a;
+			player2.root_policy = root_policy_b;
+			player1.rollout_policy = rollout_policy_a;
+			player2.rollout_policy = rollout_policy_b;
 
 			player1.opponent = &player2;
 			player2.opponent = &player1;
@@ -205,19 +212,97 @@ void TestAIs(int ai_level_a, int ai_level_b, const vector<int>& seed_list, const
 	}
 
 	ai_stat_a.UpdateEval();
-	cout << "AI_A level: " << ai_level_a << endl;
+	cout << "AI_A level: " << ai_level_a << ", root policy: " << root_policy_a << ", rollout policy: " << rollout_policy_a << endl;
 	cout << "AI_A total matches: " << ai_stat_a.total_num << endl;
 	cout << "AI_A wins: " << ai_stat_a.num_wins << endl;
 	cout << "AI_A losses: " << ai_stat_a.num_losses << endl;
 	cout << "AI_A eval: " << ai_stat_a.eval << endl;
 	ai_stat_b.UpdateEval();
-	cout << "AI_B level: " << ai_level_b << endl;
+	cout << "AI_B level: " << ai_level_b << ", root policy: " << root_policy_b << ", rollout policy: " << rollout_policy_b << endl;
 	cout << "AI_B total matches: " << ai_stat_b.total_num << endl;
 	cout << "AI_B wins: " << ai_stat_b.num_wins << endl;
 	cout << "AI_B losses: " << ai_stat_b.num_losses << endl;
 	cout << "AI_B eval: " << ai_stat_b.eval << endl;
 }
 
+void TraceMatchHashes(int ai_level, int seed, int card_pool_size, int deck_size, vector<unsigned long long>& hash_trace) // everything (card pool, decks, match) is derived from the seed so that a rerun reproduces the same match as long as the simulation behaves the same; the state hash is recorded after every turn
+{
+	vector<int> seed_list = GenerateCardSetSeeds(card_pool_size, seed);
+	vector<int> deck_a_indices = CreateRandomSelection(card_pool_size, deck_size);
+	vector<int> deck_b_indices = CreateRandomSelection(card_pool_size, deck_size);
+	vector<int> deck_a_seeds(deck_size);
+	vector<int> deck_b_seeds(deck_size);
+
+	InitMatch(seed_list, deck_a_indices, deck_b_indices, deck_a_seeds, deck_b_seeds);
+
+	vector<Card*> deck_a = GenerateRandDeckFromSeedList(deck_a_seeds);
+	vector<Card*> deck_b = GenerateRandDeckFromSeedList(deck_b_seeds);
+
+	queue<DeferredEvent*> event_queue;
+	Player player1("AI_A", 30, deck_a, true, event_queue, ai_level);
+	Player player2("AI_B", 30, deck_b, true, event_queue, ai_level);
+
+	player1.opponent = &player2;
+	player2.opponent = &player1;
+
+	player1.SetAllCardAfflications();
+	player2.SetAllCardAfflications();
+
+	player1.InitialCardDraw(false);
+	player2.InitialCardDraw(true);
+
+	hash_trace.clear();
+	hash_trace.push_back(player1.GetStateHash());
+	while (true)
+	{
+		player1.StartTurn();
+		(player1.*(player1.input_func))();
+		hash_trace.push_back(player1.GetStateHash());
+		if (player1.CheckLose() || player2.CheckLose())
+			break;
+
+		player2.StartTurn();
+		(player2.*(player2.input_func))();
+		hash_trace.push_back(player1.GetStateHash());
+		if (player1.CheckLose() || player2.CheckLose())
+			break;
+	}
+
+	while (!event_queue.empty())
+	{
+		delete event_queue.front(); // note: this is not deleting the actual card but the entity for flagging
+		event_queue.pop();
+	}
+}
+
+bool TestEffectPrograms(int ai_level, int seed, int card_pool_size, int deck_size) // run the same match walking the effect chains and through the compiled effect programs, return whether the two agree on every turn
+{
+	vector<unsigned long long> tree_trace, program_trace;
+
+	bool orig_use_effect_programs = use_effect_programs;
+	use_effect_programs = false;
+	TraceMatchHashes(ai_level, seed, card_pool_size, deck_size, tree_trace);
+	use_effect_programs = true;
+	TraceMatchHashes(ai_level, seed, card_pool_size, deck_size, program_trace);
+	use_effect_programs = orig_use_effect_programs;
+
+	int n_turns = (tree_trace.size() < program_trace.size() ? tree_trace.size() : program_trace.size());
+	for (int i = 0; i < n_turns; i++)
+		if (tree_trace[i] != program_trace[i])
+		{
+			cout << "Mismatch at turn " << i << "." << endl;
+			return false;
+		}
+	if (tree_trace.size() != program_trace.size())
+	{
+		cout << "Mismatch in match length: " << tree_trace.size() << " vs " << program_trace.size() << "." << endl;
+		return false;
+	}
+
+	cout << "Matched (" << n_turns << " states)." << endl;
+	return true;
+}
+
 int SimulateSingleMatchBetweenDecks(int ai_level, const vector<int>& seed_list, const vector<int>& deck_a_orig_indices, const vector<int>& deck_b_orig_indices, vector<MatchStat>& card_stats, MatchStat& deck_a_stat, MatchStat& deck_b_stat, int deck_size) // return number of turns when the match ends, both sides summed
 {
 	vector<int> deck_a_indices = deck_a_orig_indices; // make a copy so that if needed it is easier to reproduce with shuffling from the original order
@@ -227,6 +312,11 @@ int SimulateSingleMatchBetweenDecks(int ai_level, const vector<int>& seed_list,
 
 	InitMatch(seed_list, deck_a_indices, deck_b_indices, deck_a_seeds, deck_b_seeds);
 
+	MatchReplay replay;
+	bool is_recording = Match_Replay_Fs.is_open();
+	if (is_recording)
+		replay.Begin(deck_a_seeds, deck_b_seeds, 30);
+
 	vector<Card*> deck_a = GenerateRandDeckFromSeedList(deck_a_seeds);
 	vector<Card*> deck_b = GenerateRandDeckFromSeedList(deck_b_seeds);
 
@@ -234,6 +324,14 @@ int SimulateSingleMatchBetweenDecks(int ai_level, const vector<int>& seed_list,
 	Player player1("AI_Deck_A", 30, deck_a, true, event_queue, ai_level);
 	Player player2("AI_Deck_B", 30, deck_b, true, event_queue, ai_level);
 
+	if (is_recording)
+	{
+		player1.replay = &replay;
+		player1.replay_player_index = 0;
+		player2.replay = &replay;
+		player2.replay_player_index = 1;
+	}
+
 	vector<int> contribution_counters_a(deck_size, 0);
 	player1.RegisterCardContributions(contribution_counters_a);
 	vector<int> contribution_counters_b(deck_size, 0);
@@ -267,6 +365,9 @@ int SimulateSingleMatchBetweenDecks(int ai_level, const vector<int>& seed_list,
 		event_queue.pop();
 	}
 
+	if (is_recording)
+		replay.Write(Match_Replay_Fs);
+
 	int sum_contribution_a = 0;
 	for (int k = 0; k < deck_size; k++)
 		sum_contribution_a += contribution_counters_a[k];
@@ -820,11 +921,11 @@ void WriteDataDeckSorted(const vector<int>& card_seeds, const vector<vector<int>
 	fs.clear();		
 }
 
-void PrepareData(const vector<int>& card_seeds, const vector<MatchStat>& card_stats, vector<CardRep>& card_reps, vector<double>& card_strengths, vector<double>& card_weights, bool write_raw_to_file = true, bool write_processed_to_file = true)
+void PrepareData(const vector<int>& card_seeds, const vector<MatchStat>& card_stats, vector<CardRep>& card_reps, vector<double>& card_strengths, vector<double>& card_weights, bool write_raw_to_file = true, bool write_processed_to_file = true, int num_workers = 1) // num_workers other than 1 generates the reps in parallel (0 means all cores), only call it that way before any CardNet is constructed
 {
 	int p = card_seeds.size();
 
-	GetCardRepsFromSeeds(card_seeds, card_reps);
+	GetCardRepsFromSeedsParallel(card_seeds, card_reps, num_workers);
 
 	card_strengths.resize(p);
 	card_weights.resize(p);
@@ -1043,6 +1144,9 @@ int main(int argc, char* argv[]) // argument order, if supplied: mode, seed, fil
 	cout << "12 : Test new random cards against an environment represented with a large number of (random) decks to see how network prediction performs." << endl;
 	cout << "13 : Update the prediction test results against a prediction model (may or may not be trained from a different environment)." << endl;
 	cout << "14 : Miscellaneous performance tests." << endl;
+	cout << "15 : Differential test of the compiled effect programs against the effect trees." << endl;
+	cout << "16 : Replay a match recorded during simulation (mode 4 or 5) at any step." << endl;
+	cout << "17 : Count allocations per match with and without the allocation pools." << endl;
 	
 	int mode;
 	if (argc > 1)
@@ -1114,6 +1218,129 @@ int main(int argc, char* argv[]) // argument order, if supplied: mode, seed, fil
 			fs_human.clear();
 		}
 		break;*/
+	case 17:
+		{
+			int p = 1000;
+			int deck_num = 100;
+			int match_num = 200; // number of pair matches for each setting
+			unsigned ai_level = 2;
+
+			if (argc > 2)
+			{
+				seed = atoi(argv[2]);
+			}
+			else
+			{
+				cout << "Input Seed" << endl;
+				cin >> seed;
+			}
+			cout << "Seed for simulation: " << seed << endl;
+
+			bool orig_use_alloc_pools = use_alloc_pools;
+			unsigned long long num_news[2], num_sys_allocs[2];
+			for (int k = 0; k < 2; k++)
+			{
+				use_alloc_pools = (k == 1);
+
+				// same seed for both settings, the simulation does not depend on the allocation
+				vector<int> seed_list = GenerateCardSetSeeds(p, seed);
+				vector<vector<int>> deck_list;
+				for (int i = 0; i < deck_num; i++)
+					deck_list.push_back(CreateRandomSelection(p, n));
+				vector<MatchStat> card_stats(p);
+				vector<MatchStat> deck_stats(deck_num);
+
+				AllocCounts counts_0 = GetAllocCounts();
+				for (int i = 0; i < match_num; i++)
+				{
+					int index_a = GetGiglRandInt(deck_num);
+					int index_b = GetGiglRandInt(deck_num);
+					SimulatePairMatchBetweenDecks(ai_level, seed_list, deck_list[index_a], deck_list[index_b], card_stats, deck_stats[index_a], deck_stats[index_b], n);
+				}
+				AllocCounts counts_1 = GetAllocCounts();
+
+				num_news[k] = counts_1.num_news - counts_0.num_news;
+				num_sys_allocs[k] = counts_1.num_sys_allocs - counts_0.num_sys_allocs;
+			}
+			use_alloc_pools = orig_use_alloc_pools;
+
+			/* allocation report */
+			cout << endl;
+			cout << "Total number of matches per setting: " << match_num * 2 << endl;
+			cout << "Without pools, allocations per match: " << num_news[0] / (match_num * 2.0) << ", to the system allocator: " << num_sys_allocs[0] / (match_num * 2.0) << endl;
+			cout << "With pools, allocations per match: " << num_news[1] / (match_num * 2.0) << ", to the system allocator: " << num_sys_allocs[1] / (match_num * 2.0) << endl;
+		}
+		break;
+	case 16:
+		{
+			// seed field will still exist but not used (argv[2])
+			if (argc > 3)
+				Match_Replay_Path = argv[3];
+
+			int match_index;
+			cout << "Input the index of the match in the replay file (in the order they were simulated, zero-indexed)" << endl;
+			cin >> match_index;
+
+			ifstream fs(Match_Replay_Path, ios::binary);
+			MatchReplay replay;
+			bool is_found = true;
+			for (int i = 0; i <= match_index && is_found; i++)
+				is_found = replay.Read(fs);
+			if (!is_found)
+			{
+				cout << "Error: match not found in " << Match_Replay_Path << "." << endl;
+				exit(1);
+			}
+			cout << "Match seed: " << replay.match_seed << ". Number of steps: " << replay.steps.size() << "." << endl;
+
+			MatchReplayer replayer(replay);
+			int step;
+			while (true)
+			{
+				cout << "Input step to view (0 ~ " << replay.steps.size() << ", negative to quit)" << endl;
+				cin >> step;
+				if (step < 0)
+					break;
+				replayer.SeekTo(step);
+				replayer.first_player->PrintBoard();
+				cout << "Step: " << replayer.curr_step << (replayer.IsEnded() ? " (match ended)" : "") << ". State hash: " << replayer.first_player->GetStateHash() << endl;
+			}
+		}
+		break;
+	case 15:
+		{
+			int p = 50;
+			int n_matches = 100;
+
+			if (argc > 2)
+			{
+				seed = atoi(argv[2]);
+			}
+			else
+			{
+				cout << "Input Seed" << endl;
+				cin >> seed;
+			}
+			cout << "Seed for simulation: " << seed << endl;
+
+			unsigned ai_level;
+			cout << "Input AI level - 0: Pure Random; 1 ~ 9: Search Based (higher number does more trials)" << endl;
+			cin >> ai_level;
+
+			vector<int> match_seeds = GenerateCardSetSeeds(n_matches, seed);
+			int n_failed = 0;
+			for (int i = 0; i < n_matches; i++)
+			{
+				cout << "Match " << i << ". ";
+				if (!TestEffectPrograms(ai_level, match_seeds[i], p, n))
+					n_failed++;
+			}
+
+			cout << endl;
+			cout << "Total number of matches tested: " << n_matches << endl;
+			cout << "Mismatched matches: " << n_failed << endl;
+		}
+		break;
 	case 14:
 		{
 			int n_test_cards = 1000000;
@@ -1130,27 +1357,48 @@ int main(int argc, char* argv[]) // argument order, if supplied: mode, seed, fil
 
 			if (argc > 3)
 				Card_Model_Path = argv[3];
-			
-			// load network model
-			CardNet card_net;
-			LoadCardModel(card_net);
 
+			int num_workers = 1; // with more than one worker (0 means all cores) the cards are generated in parallel directly as reps, so there are no cards to delete
+			if (argc > 4)
+				num_workers = atoi(argv[4]);
+			
 			vector<int> seed_list = GenerateCardSetSeeds(n_test_cards, seed);
-			vector<Card*> card_list(n_test_cards);
+			vector<Card*> card_list;
+			vector<CardRep> card_reps;
 			
 			time_t timer_0 = time(NULL);
 
-			for (int i = 0; i < n_test_cards; i++)
-				card_list[i] = GenerateSingleCard(seed_list[i]);
+			if (num_workers == 1)
+			{
+				card_list.resize(n_test_cards);
+				for (int i = 0; i < n_test_cards; i++)
+					card_list[i] = GenerateSingleCard(seed_list[i]);
+			}
+			else
+				GetCardRepsFromSeedsParallel(seed_list, card_reps, num_workers);
 				
 			time_t timer_1 = time(NULL);
 
-			for (int i = 0; i < n_test_cards; i++)
-				PredictCardStrength(card_list[i], card_net);
+			// load network model (only after the generation, its workers cannot be forked once torch is initialized)
+			CardNet card_net;
+			LoadCardModel(card_net);
+
+			time_t timer_loaded = time(NULL);
+
+			if (num_workers == 1)
+			{
+				for (int i = 0; i < n_test_cards; i++)
+					PredictCardStrength(card_list[i], card_net);
+			}
+			else
+			{
+				for (int i = 0; i < n_test_cards; i++)
+					PredictCardStrength(card_reps[i], card_net);
+			}
 
 			time_t timer_2 = time(NULL);
 
-			for (int i = 0; i < n_test_cards; i++)
+			for (int i = 0; i < card_list.size(); i++)
 				DeleteCard(card_list[i]);
 
 			time_t timer_3 = time(NULL);
@@ -1160,7 +1408,7 @@ int main(int argc, char* argv[]) // argument order, if supplied: mode, seed, fil
 			cout << "Total number cards tested: " << n_test_cards << endl;
 			double generate_time = difftime(timer_1, timer_0);
 			cout << "Card generation time: " << generate_time << endl;
-			double predict_time = difftime(timer_2, timer_1);
+			double predict_time = difftime(timer_2, timer_loaded);
 			cout << "Card strength prediction time (including preprocessing inputs): " << predict_time << endl;
 			double delete_time = difftime(timer_3, timer_2);
 			cout << "Card deletion time: " << delete_time << endl;
@@ -1620,7 +1868,17 @@ int main(int argc, char* argv[]) // argument order, if supplied: mode, seed, fil
 			cin >> ai_level_a;
 			cout << "Input AI level for the first AI - 0: Pure Random; 1 ~ 9: Search Based (higher number does more trials)" << endl;
 			cin >> ai_level_b;
-			TestAIs(ai_level_a, ai_level_b, seed_list, deck_list, deck_num, n);
+			int root_policy_a, root_policy_b;
+			cout << "Input root policy for the first AI - 0: UCB-1; 1: Sequential Halving over actions; 2: Sequential Halving over options" << endl;
+			cin >> root_policy_a;
+			cout << "Input root policy for the second AI - 0: UCB-1; 1: Sequential Halving over actions; 2: Sequential Halving over options" << endl;
+			cin >> root_policy_b;
+			int rollout_policy_a, rollout_policy_b;
+			cout << "Input rollout policy for the first AI - 0: Random; 1: Greedy" << endl;
+			cin >> rollout_policy_a;
+			cout << "Input rollout policy for the second AI - 0: Random; 1: Greedy" << endl;
+			cin >> rollout_policy_b;
+			TestAIs(ai_level_a, ai_level_b, root_policy_a, root_policy_b, rollout_policy_a, rollout_policy_b, seed_list, deck_list, deck_num, n);
 		}
 		break;
 	case 8:
@@ -1722,7 +1980,6 @@ int main(int argc, char* argv[]) // argument order, if supplied: mode, seed, fil
 				cin >> seed;
 			}
 			srand(seed);
-			torch::manual_seed(seed);
 
 			if (argc > 3)
 			{
@@ -1765,7 +2022,8 @@ int main(int argc, char* argv[]) // argument order, if supplied: mode, seed, fil
 			vector<CardRep> card_reps;
 			vector<double> card_strengths;
 			vector<double> card_weights;
-			PrepareData(seed_list, card_stats, card_reps, card_strengths, card_weights, false); // false means don't rewrite the raw data (it will rewrite the processed and human data)
+			PrepareData(seed_list, card_stats, card_reps, card_strengths, card_weights, false, true, 0); // false means don't rewrite the raw data (it will rewrite the processed and human data); the reps are generated with all cores, as torch is only initialized afterwards
+			torch::manual_seed(seed);
 
 			vector<CardRep> train_reps, validate_reps;
 			vector<double> train_strengths, validate_strengths;
@@ -1841,6 +2099,36 @@ int main(int argc, char* argv[]) // argument order, if supplied: mode, seed, fil
 			string Match_Deck_Data_Path_Skip = "match_deck_data_skip.txt";
 			if (argc > 6)
 				Match_Deck_Data_Path_Skip = argv[6];
+			if (argc > 7 && string(argv[7]) != "-") // the replays are only recorded if a path is given ("-" to skip), as recording reseeds the generator on every action and so changes the simulated matches
+			{
+				Match_Replay_Path = argv[7];
+				Match_Replay_Fs.open(Match_Replay_Path, ios::binary);
+			}
+			if (argc > 8 && string(argv[8]) != "-")
+				EnableTrace(argv[8]); // the event trace is only collected if a path prefix is given ("-" to skip)
+			if (argc > 9)
+				search_time_per_decision = atof(argv[9]); // seconds per decision of the search AI (anytime mode), trading strength for throughput
+			if (argc > 10)
+			{
+				early_stopping_delta = atof(argv[10]); // confidence parameter of the stopping rule of the search AI, zero (default) to always spend the full rollout budget
+				use_early_stopping = (early_stopping_delta > 0.0);
+			}
+			if (argc > 11)
+				default_root_policy = atoi(argv[11]); // ROOT_POLICY_UCB (default), ROOT_POLICY_SEQ_HALVING or ROOT_POLICY_SEQ_HALVING_OPTIONS
+			if (argc > 12)
+				use_turn_plan = (atoi(argv[12]) != 0); // whether the search AI plans the rest of the turn at once (replanning only after random outcomes)
+			if (argc > 13)
+				use_ismcts = (atoi(argv[13]) != 0); // whether every rollout of the search AI samples its own determinization of the hidden cards
+			if (argc > 14)
+				search_lookahead_depth = atoi(argv[14]); // number of turns the rollouts of the search AI play after its own turn, 1 for the opponent's reply
+			if (argc > 15)
+				default_rollout_policy = atoi(argv[15]); // ROLLOUT_POLICY_RANDOM (default) or ROLLOUT_POLICY_GREEDY
+			if (argc > 16)
+				num_search_workers = atoi(argv[16]); // processes the rollouts of a decision are split over, 1 (default) for none, 0 for one per core
+			if (argc > 17)
+				parallel_search_mode = atoi(argv[17]); // PARALLEL_SEARCH_ROOT (default) or PARALLEL_SEARCH_TREE
+			if (argc > 18)
+				search_time_per_turn = atof(argv[18]); // cap in seconds on the search time of a whole turn of the search AI, 0 (default) for no cap
 
 			/*cout << "Input AI level - 0: Pure Random; 1 ~ 9: Search Based (higher number does more trials)" << endl;
 			unsigned ai_level;
@@ -1878,13 +2166,17 @@ int main(int argc, char* argv[]) // argument order, if supplied: mode, seed, fil
 			cout << "Total number of match turns simulated: " << turn_count << endl; 
 			double total_time = difftime(timer_1, timer_0);
 			cout << "Total testing time: " << total_time << endl;
+			SearchStats search_stats = GetSearchStats();
+			cout << "Search decisions: " << search_stats.num_decisions << ", rollouts: " << search_stats.num_rollouts << ", rollouts saved by early stopping: " << search_stats.num_rollouts_saved << endl;
+			if (search_stats.num_lookahead_evals > 0)
+				cout << "Lookahead cache hit rate: " << search_stats.num_lookahead_cache_hits / (double)search_stats.num_lookahead_evals << endl;
 			
 			/* prepare data for training/post processing */
 			// card
 			vector<CardRep> card_reps;
 			vector<double> card_strengths;
 			vector<double> card_weights;
-			PrepareData(seed_list, card_stats, card_reps, card_strengths, card_weights);
+			PrepareData(seed_list, card_stats, card_reps, card_strengths, card_weights, true, true, 0); // all cores for the reps, torch is not used in this mode
 			// decks
 			vector<int> deck_indices(deck_num);
 			SortStatInIndices(deck_stats, deck_indices);
@@ -1991,6 +2283,36 @@ int main(int argc, char* argv[]) // argument order, if supplied: mode, seed, fil
 			string Match_Deck_Data_Path = "match_deck_data.txt";
 			if (argc > 4)
 				Match_Deck_Data_Path = argv[4];
+			if (argc > 5 && string(argv[5]) != "-") // the replays are only recorded if a path is given ("-" to skip), as recording reseeds the generator on every action and so changes the simulated matches
+			{
+				Match_Replay_Path = argv[5];
+				Match_Replay_Fs.open(Match_Replay_Path, ios::binary);
+			}
+			if (argc > 6 && string(argv[6]) != "-")
+				EnableTrace(argv[6]); // the event trace is only collected if a path prefix is given ("-" to skip)
+			if (argc > 7)
+				search_time_per_decision = atof(argv[7]); // seconds per decision of the search AI (anytime mode), trading strength for throughput
+			if (argc > 8)
+			{
+				early_stopping_delta = atof(argv[8]); // confidence parameter of the stopping rule of the search AI, zero (default) to always spend the full rollout budget
+				use_early_stopping = (early_stopping_delta > 0.0);
+			}
+			if (argc > 9)
+				default_root_policy = atoi(argv[9]); // ROOT_POLICY_UCB (default), ROOT_POLICY_SEQ_HALVING or ROOT_POLICY_SEQ_HALVING_OPTIONS
+			if (argc > 10)
+				use_turn_plan = (atoi(argv[10]) != 0); // whether the search AI plans the rest of the turn at once (replanning only after random outcomes)
+			if (argc > 11)
+				use_ismcts = (atoi(argv[11]) != 0); // whether every rollout of the search AI samples its own determinization of the hidden cards
+			if (argc > 12)
+				search_lookahead_depth = atoi(argv[12]); // number of turns the rollouts of the search AI play after its own turn, 1 for the opponent's reply
+			if (argc > 13)
+				default_rollout_policy = atoi(argv[13]); // ROLLOUT_POLICY_RANDOM (default) or ROLLOUT_POLICY_GREEDY
+			if (argc > 14)
+				num_search_workers = atoi(argv[14]); // processes the rollouts of a decision are split over, 1 (default) for none, 0 for one per core
+			if (argc > 15)
+				parallel_search_mode = atoi(argv[15]); // PARALLEL_SEARCH_ROOT (default) or PARALLEL_SEARCH_TREE
+			if (argc > 16)
+				search_time_per_turn = atof(argv[16]); // cap in seconds on the search time of a whole turn of the search AI, 0 (default) for no cap
 
 			/*cout << "Input AI level - 0: Pure Random; 1 ~ 9: Search Based (higher number does more trials)" << endl;
 			unsigned ai_level;
@@ -2107,13 +2429,17 @@ int main(int argc, char* argv[]) // argument order, if supplied: mode, seed, fil
 			double final_time = difftime(timer_3, timer_2);
 			cout << "Final deck pool testing time: " << final_time << endl;	
 			cout << "Total testing time: " << init_time + evolve_time + final_time << endl;
+			SearchStats search_stats = GetSearchStats();
+			cout << "Search decisions: " << search_stats.num_decisions << ", rollouts: " << search_stats.num_rollouts << ", rollouts saved by early stopping: " << search_stats.num_rollouts_saved << endl;
+			if (search_stats.num_lookahead_evals > 0)
+				cout << "Lookahead cache hit rate: " << search_stats.num_lookahead_cache_hits / (double)search_stats.num_lookahead_evals << endl;
 
 			/* prepare data for training/post processing */
 			// cards
 			vector<CardRep> card_reps;
 			vector<double> card_strengths;
 			vector<double> card_weights;
-			PrepareData(seed_list, card_stats, card_reps, card_strengths, card_weights);
+			PrepareData(seed_list, card_stats, card_reps, card_strengths, card_weights, true, true, 0); // all cores for the reps, torch is not used in this mode
 			// decks
 			vector<int> deck_indices(deck_pool_size);
 			SortStatInIndices(deck_stats, deck_indices);
@@ -2285,6 +2611,18 @@ int main(int argc, char* argv[]) // argument order, if supplied: mode, seed, fil
 			cout << "Input AI level - 0: Pure Random; 1 ~ 9: Search Based (higher number does more trials)" << endl;
 			unsigned ai_level;
 			cin >> ai_level;
+			cout << "Input number of search workers of the AI (1 for a single process, 0 for all cores)" << endl;
+			cin >> num_search_workers;
+			parallel_search_mode = PARALLEL_SEARCH_ROOT;
+			if (num_search_workers != 1)
+			{
+				cout << "Input parallel search mode - 0: Root (separate statistics per worker, merged); 1: Tree (statistics shared between workers, but without the persistent turn tree and the stopping rule, so the search stats report no saved rollouts)" << endl;
+				cin >> parallel_search_mode;
+			}
+			cout << "Input search time per decision of the AI in seconds (0 for the usual rollout budget)" << endl;
+			cin >> search_time_per_decision;
+			cout << "Input cap on the search time per turn of the AI in seconds (0 for no cap)" << endl;
+			cin >> search_time_per_turn;
 
 			queue<DeferredEvent*> event_queue;
 			Player human_player("Player", 30, deck1, false, event_queue);